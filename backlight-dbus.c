@@ -1,6 +1,11 @@
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -8,8 +13,42 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
+#include <linux/netlink.h>
+#ifdef WITH_KEYS
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#endif
+#ifdef WITH_SCHEDULE
+#include <sys/timerfd.h>
+#endif
+#ifdef WITH_DDC
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#endif
+#ifdef WITH_DBUS
+#ifdef RAW_DBUS
+#include "raw-dbus.h"
+#else
 #include <systemd/sd-bus.h>
+#endif
+#endif
+
+#if !defined(WITH_DBUS) && !defined(WITH_SYSFS)
+#error "No brightness backend selected, see BACKENDS in the Makefile"
+#endif
+// Idle dimming follows logind, so it needs the bus
+#if defined(WITH_IDLE) && !defined(WITH_DBUS)
+#undef WITH_IDLE
+#endif
 
 #define LOG_INFO(args...) if (debug_on) fprintf(stderr, args)
 #define LOG_ERROR(args...) fprintf(stderr, args)
@@ -18,13 +57,221 @@
 #define NANOSEC_PER_SEC 1000000000LL
 #define NANOSEC_PER_MILLISEC 1000000LL
 #define MILLISEC_PER_SEC 1000
-#define SLEEP_MILLIS 100
+#define DEFAULT_STEPS_PER_SEC 60
+#define MAX_STEPS_PER_SEC 1000
+// Solution of e^-x * (1+x) = 0.01, i.e. a critically damped spring is
+// within 1% of its target after SPRING_SETTLE_FACTOR / omega seconds
+#define SPRING_SETTLE_FACTOR 6.64
+#define SUPERSEDE_TIMEOUT_MILLIS 1000
+#define DEFAULT_TYPE_PREFERENCE "firmware,platform,raw"
+// Size of the device name index; must be a power of two and larger than
+// the number of devices
+#define DEVICE_INDEX_SIZE 64
+#define UEVENT_BUFFER_SIZE 8192
+#define CACHE_VALUE_MAX 255
+#define CACHE_VALUE_MAX_STR "255"
+// How long a committed target stays authoritative after its fade ends
+#define STATE_GRACE_MILLIS 1000
+// Longest interval between reads in --follow for devices which don't notify
+#define FOLLOW_POLL_MAX_MILLIS 2000
+// Longest command line accepted by --stdin
+#define COMMAND_BUFFER_SIZE 1024
+// With --keys, the step grows by the initial step every KEY_ACCEL_REPEATS
+// autorepeats of a held key, up to KEY_ACCEL_MAX_FACTOR times its size
+#define DEFAULT_KEY_STEP_PERCENT 5
+#define KEY_ACCEL_REPEATS 5
+#define KEY_ACCEL_MAX_FACTOR 4
+#define IIO_DEVICES_DIR "/sys/bus/iio/devices"
+// With --auto, readings within ALS_HYSTERESIS_PERCENT (plus
+// ALS_HYSTERESIS_MIN_LUX, for the dark) of the one which last changed the
+// brightness are ignored. The sysfs attribute is polled every
+// ALS_POLL_MIN_MILLIS after a change, backing off to ALS_POLL_MAX_MILLIS.
+#define DEFAULT_ALS_CURVE "0:5,10:20,100:40,1000:70,10000:100"
+#define DEFAULT_ALS_JND_PERCENT 2
+#define ALS_CURVE_MAX_POINTS 16
+#define ALS_SCAN_MAX_CHANNELS 16
+#define ALS_READ_BUFFER_SIZE 1024
+#define ALS_HYSTERESIS_PERCENT 10
+#define ALS_HYSTERESIS_MIN_LUX 1
+#define ALS_POLL_MIN_MILLIS 250
+#define ALS_POLL_MAX_MILLIS 4000
+// DDC/CI: the display's I2C address, and the VCP feature for luminance. A
+// monitor needs the inter-command delay (--ddc-delay) after each command
+// and DDC_REPLY_DELAY_MILLIS to prepare a reply. Readings are trusted for
+// DDC_CACHE_MILLIS, so that repeated steps don't each wait for one.
+#define DDC_I2C_ADDRESS 0x37
+#define DDC_HOST_ADDRESS 0x51
+#define DDC_VCP_BRIGHTNESS 0x10
+#define DEFAULT_DDC_DELAY_MILLIS 50
+#define MAX_DDC_DELAY_MILLIS 1000
+#define DDC_REPLY_DELAY_MILLIS 40
+#define DDC_READ_ATTEMPTS 3
+#define DDC_CACHE_MILLIS 2000
+#define DDC_MAX_BUSY 16
+// With --low-jitter, the timer slack, and the priority of the realtime
+// scheduling policy if one is requested
+#define LOW_JITTER_TIMER_SLACK_NANOS 1000
+#define LOW_JITTER_PRIORITY 1
+// --stats reports the lateness of this many fade steps at most, the last
+#define STEP_LATENESS_SAMPLES 65536
 
 static bool debug_on = false;
+static bool profile_on = false;
+static struct timespec profile_start;
 static volatile sig_atomic_t received_signal = false;
-static int signals_to_catch[] = {SIGHUP, SIGINT, SIGTERM, 0};
+// Set when another instance took over the device; we must not restore
+// the original brightness in that case
+static volatile sig_atomic_t superseded = false;
+// Set to stop a fade and restore the original brightness without a signal,
+// e.g. when the session wakes up during a dim
+static volatile sig_atomic_t interrupted = false;
+static int signals_to_catch[] = {SIGHUP, SIGINT, SIGTERM, SIGUSR1, 0};
 static sigset_t signals_to_catch_set;
+// What fades measure progress on. CLOCK_MONOTONIC stops while suspended,
+// CLOCK_BOOTTIME doesn't.
+static clockid_t fade_clock = CLOCK_BOOTTIME;
+#ifdef WITH_DDC
+static int ddc_delay_millis = DEFAULT_DDC_DELAY_MILLIS;
+#endif
+// Open addressing hash index from device name to position in the device
+// list, holding position+1 so that 0 means empty. There is only one device
+// list per process.
+static int device_index[DEVICE_INDEX_SIZE];
+
+struct fade_stats {
+    int levels;     // distinct values between start and target
+    int calls;      // SetBrightness calls actually issued
+    int merged;     // steps dropped by the JND threshold
+    // How late fade steps woke up, in microseconds, as a ring of the last
+    // STEP_LATENESS_SAMPLES; NULL if not collected
+    int32_t *lateness;
+    int num_steps;
+};
+
+struct candidate {
+    char name[NAME_MAX+1];
+    int rank;
+};
+
+struct device {
+    char name[NAME_MAX+1];
+    const char *subsystem;  // "backlight", "leds" or "ddc"
+    int orig_brightness;
+    int cur_brightness;     // last value sent
+    int max_brightness;
+    int target_brightness;
+    int lock_fd;
+#ifdef WITH_SYSFS
+    int brightness_fd;      // open for writing if set directly through sysfs
+#endif
+#ifdef WITH_DDC
+    int ddc_fd;             // /dev/i2c-N of a monitor, or -1
+    int ddc_cache_fd;       // its cache file in XDG_RUNTIME_DIR, or -1
+    int ddc_pending;        // level to write once the monitor is ready, or -1
+    int64_t ddc_ready_nanos;    // when it takes the next command, on fade_clock
+    int64_t ddc_cached_nanos;   // when ddc_value was last read or written
+    int ddc_value;
+    int ddc_max;
+#endif
+    bool call_pending;      // a SetBrightness call is in flight, or a DDC/CI
+                            // monitor is still busy with the last write
+    bool failed;
+    bool removed;           // unplugged while running
+    // Watching for changes made by others during a fade
+    int actual_fd;          // actual_brightness, or -1 if not watched
+    int observed_brightness;
+    bool overridden;        // changed by someone else; left alone
+    // The fade runs from fade_from at fade_start_millis to the target
+    int fade_from;
+    int fade_start_millis;
+};
+
+#ifdef WITH_DBUS
+// The logind session we act on. With a session ID, the object path is
+// derived locally and only checked against logind if the first method
+// call fails.
+struct session {
+    const char *id;
+    char *path;
+    bool verified;
+};
+#endif
+
+// Where brightness changes go. Devices whose brightness attribute we may
+// write are set directly, the others through logind. The bus is in use
+// once the session path is known.
+struct backend {
+#ifdef WITH_DBUS
+    sd_bus *bus;
+    struct session session;
+    bool watching_sleep;    // the bus is needed for PrepareForSleep
+#endif
+#ifdef WITH_DDC
+    // Monitors within their inter-command delay, which may have a write
+    // held back until it is over
+    struct device *ddc_busy[DDC_MAX_BUSY];
+    int num_ddc_busy;
+#endif
+};
+
+struct uevent {
+    const char *action;
+    const char *subsystem;
+    const char *name;
+};
+
+// The target most recently committed for a device. sysfs lags behind a
+// fade in progress or a set which logind hasn't applied yet, so relative
+// adjustments are applied to this instead while it is fresh. Only the
+// holder of the device lock reads or writes it.
+struct device_state {
+    int32_t target;
+    int32_t max_brightness;
+    int64_t expires_nanos;  // CLOCK_BOOTTIME
+};
 
+// A critically damped spring pulling the brightness towards target.
+// Position and velocity are stored relative to time t0, when the spring
+// was last retargeted.
+struct spring {
+    double target;
+    double offset;      // position - target at t0
+    double velocity;    // levels per second at t0
+    double omega;
+    double t0;
+};
+
+// What a fade does when someone else changes the brightness
+enum external_policy {
+    EXTERNAL_IGNORE,    // carry on overwriting it
+    EXTERNAL_ABORT,     // leave the device where it was put
+    EXTERNAL_RETARGET,  // fade on to the target from there
+};
+
+// What a fade does when logind announces that the system is going to sleep
+enum sleep_policy {
+    SLEEP_IGNORE,       // keep stepping as long as we run
+    SLEEP_PAUSE,        // hold the level, and go on from there on resume
+    SLEEP_CONTINUE,     // hold the level, and go on per the clock on resume
+    SLEEP_COMPLETE,     // jump to the target
+};
+
+// Output formats of --query and --follow
+enum query_format {
+    QUERY_TSV,
+    QUERY_JSON,
+    QUERY_PERCENT,
+};
+
+struct query_result {
+    int brightness;
+    int actual_brightness;
+    bool have_actual;
+    int max_brightness;
+    char type[32];
+};
+
+#ifdef WITH_DBUS
 void log_method_call_failed(const sd_bus_error *error) {
     LOG_ERROR("Failed to issue method call: %s\n", error->message);
 }
@@ -32,49 +279,23 @@ void log_method_call_failed(const sd_bus_error *error) {
 void log_parse_failed(int status) {
     LOG_ERROR("Failed to parse response message: %s\n", strerror(-status));
 }
+#endif
 
-void signal_handler(int signum) {
-    received_signal = true;
+// Print the time since startup for --profile
+void profile_mark(const char *what) {
+    struct timespec now;
+    if (!profile_on) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(stderr, "%9.3f ms  %s\n",
+            (now.tv_sec - profile_start.tv_sec) * 1e3
+            + (now.tv_nsec - profile_start.tv_nsec) / 1e6, what);
 }
 
-static int get_session_path(sd_bus *bus, char **result) {
-    char *xdg_session_id = getenv("XDG_SESSION_ID");
-    if (xdg_session_id) {
-        LOG_INFO("Found XDG_SESSION_ID=%s\n", xdg_session_id);
-        // Get the session path
-        sd_bus_error error = SD_BUS_ERROR_NULL;
-        sd_bus_message *get_session_msg = NULL;
-        int status = sd_bus_call_method(
-            bus,
-            "org.freedesktop.login1",
-            "/org/freedesktop/login1",
-            "org.freedesktop.login1.Manager",
-            "GetSession",
-            &error,
-            &get_session_msg,
-            "s",
-            xdg_session_id);
-        if (status < 0) {
-            log_method_call_failed(&error);
-            sd_bus_error_free(&error);
-            return status;
-        }
-        // Parse the response message
-        char *session_object_path = NULL;
-        status = sd_bus_message_read(get_session_msg, "o", &session_object_path);
-        if (status >= 0) {
-            *result = strdup(session_object_path);
-        }
-        sd_bus_message_unref(get_session_msg);
-        if (status < 0) {
-            log_parse_failed(status);
-            return status;
-        }
-    } else {
-        LOG_INFO("XDG_SESSION_ID not set, using auto session instead\n");
-        *result = strdup("/org/freedesktop/login1/session/auto");
+void signal_handler(int signum) {
+    received_signal = true;
+    if (signum == SIGUSR1) {
+        superseded = true;
     }
-    return 0;
 }
 
 int read_value_from_file(char *dir, size_t dir_len, size_t dir_cap,
@@ -100,33 +321,641 @@ int read_value_from_file(char *dir, size_t dir_len, size_t dir_cap,
     return 0;
 }
 
-int get_device(const char ** res) {
+// Rank of a backlight type in a comma separated preference list.
+// Lower is better; types which aren't listed come last.
+int type_rank(const char *type, const char *preference) {
+    int rank = 0;
+    size_t type_len = strlen(type);
+    while (*preference) {
+        size_t len = strcspn(preference, ",");
+        if (len == type_len && strncmp(preference, type, len) == 0) return rank;
+        rank++;
+        preference += len;
+        if (*preference == ',') preference++;
+    }
+    return rank;
+}
+
+int compare_candidates(const void *a, const void *b) {
+    const struct candidate *ca = a, *cb = b;
+    if (ca->rank != cb->rank) return ca->rank - cb->rank;
+    return strcmp(ca->name, cb->name);
+}
+
+// List the devices in /sys/class/backlight/, best first according to the
+// type preference and then by name, so that the result doesn't depend on
+// directory order. Everything is read relative to one directory fd.
+int scan_devices(const char *preference, struct candidate **res, int *count) {
     static const char *dir = "/sys/class/backlight/";
-    static char device_name_alt[NAME_MAX+1];
-    // Search for a device name
+    struct candidate *candidates = NULL;
+    int num_candidates = 0;
     DIR *dp = opendir(dir);
     if (!dp) {
         LOG_ERROR("Error opening directory %s\n", dir);
         return -1;
     }
+    int dfd = dirfd(dp);
     struct dirent *ep;
-    while ((ep = readdir(dp)) && ep->d_name[0] == '.') ;
-    if (!ep) {
+    while ((ep = readdir(dp))) {
+        char path[NAME_MAX+sizeof("/type")], type[32] = "";
+        if (ep->d_name[0] == '.') continue;
+        struct candidate *new_candidates = realloc(
+            candidates, (num_candidates+1) * sizeof(*candidates));
+        if (!new_candidates) {
+            perror("realloc");
+            free(candidates);
+            closedir(dp);
+            return -1;
+        }
+        candidates = new_candidates;
+        struct candidate *c = &candidates[num_candidates++];
+        strcpy(c->name, ep->d_name);
+        snprintf(path, sizeof(path), "%s/type", ep->d_name);
+        int fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ssize_t n = read(fd, type, sizeof(type)-1);
+            close(fd);
+            if (n > 0) {
+                type[n] = '\0';
+                type[strcspn(type, "\n")] = '\0';
+            }
+        }
+        c->rank = type_rank(type, preference);
+        LOG_INFO("Found device %s of type %s\n", c->name, type[0] ? type : "unknown");
+    }
+    closedir(dp);
+    if (num_candidates == 0) {
         LOG_ERROR("Found no device names in %s\n", dir);
-        closedir(dp);
+        free(candidates);
         return -1;
     }
-    strcpy(device_name_alt, ep->d_name);
-    closedir(dp);
+    qsort(candidates, num_candidates, sizeof(*candidates), compare_candidates);
+    *res = candidates;
+    *count = num_candidates;
+    return 0;
+}
+
+int read_boot_id(char *buf, size_t size) {
+    static char boot_id[64];
+    if (!boot_id[0]) {
+        int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        ssize_t n = read(fd, boot_id, sizeof(boot_id)-1);
+        close(fd);
+        if (n <= 0) return -1;
+        boot_id[n] = '\0';
+        boot_id[strcspn(boot_id, "\n")] = '\0';
+    }
+    if (strlen(boot_id) >= size) return -1;
+    strcpy(buf, boot_id);
+    return 0;
+}
+
+// Small caches in $XDG_RUNTIME_DIR which stay valid until the next boot.
+// Each holds one line, "<boot id> <key> <value>", and is only used if the
+// key matches the one it was written with.
+int get_cache_path(const char *name, char *buf, size_t size) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (!runtime_dir) return -1;
+    int len = snprintf(buf, size, "%s/backlight-dbus-%s", runtime_dir, name);
+    return len > (int)size-1 ? -1 : 0;
+}
+
+// value must have room for CACHE_VALUE_MAX+1 characters
+bool read_cache(const char *name, const char *key, char *value) {
+    char path[PATH_MAX], boot_id[64], cached_boot_id[64],
+         cached_key[CACHE_VALUE_MAX+1];
+    if (read_boot_id(boot_id, sizeof(boot_id)) < 0) return false;
+    if (get_cache_path(name, path, sizeof(path)) < 0) return false;
+    FILE *fi = fopen(path, "r");
+    if (fi == NULL) return false;
+    int num_read = fscanf(fi, "%63s %" CACHE_VALUE_MAX_STR "s %" CACHE_VALUE_MAX_STR "s",
+                          cached_boot_id, cached_key, value);
+    fclose(fi);
+    return num_read == 3 && strcmp(cached_boot_id, boot_id) == 0
+        && strcmp(cached_key, key) == 0;
+}
+
+void write_cache(const char *name, const char *key, const char *value) {
+    char path[PATH_MAX], tmp_path[PATH_MAX+4], boot_id[64];
+    if (read_boot_id(boot_id, sizeof(boot_id)) < 0) return;
+    if (get_cache_path(name, path, sizeof(path)) < 0) return;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fo = fopen(tmp_path, "w");
+    if (fo == NULL) return;
+    fprintf(fo, "%s %s %s\n", boot_id, key, value);
+    // Replace the old cache atomically so concurrent readers never see
+    // a partial line
+    if (fclose(fo) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+void clear_cache(const char *name) {
+    char path[PATH_MAX];
+    if (get_cache_path(name, path, sizeof(path)) == 0) {
+        unlink(path);
+    }
+}
+
+// The chosen device is cached for the rest of the boot, keyed by the
+// type preference it was chosen with
+int get_device(const char *preference, const char **res) {
+    static char device_name_alt[CACHE_VALUE_MAX+1];
+    char path[PATH_MAX];
+    if (read_cache("device", preference, device_name_alt)) {
+        // The device might have been unplugged since
+        snprintf(path, sizeof(path), "/sys/class/backlight/%s", device_name_alt);
+        if (access(path, F_OK) == 0) {
+            LOG_INFO("Using cached device choice\n");
+            *res = device_name_alt;
+            return 0;
+        }
+    }
+    struct candidate *candidates;
+    int num_candidates;
+    if (scan_devices(preference, &candidates, &num_candidates) < 0) return -1;
+    strcpy(device_name_alt, candidates[0].name);
+    free(candidates);
+    write_cache("device", preference, device_name_alt);
     *res = device_name_alt;
     return 0;
 }
 
-int read_brightness(const char *device_name, int *cur_brightness,
+unsigned int hash_name(const char *name) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+// Returns the slot for a device: either the one holding it, or the empty
+// one where it would go. Devices of different classes may share a name.
+int *device_index_slot(struct device *devices, const char *subsystem,
+                       const char *name)
+{
+    unsigned int i = hash_name(name) & (DEVICE_INDEX_SIZE-1);
+    while (device_index[i]
+           && (strcmp(devices[device_index[i]-1].name, name) != 0
+               || strcmp(devices[device_index[i]-1].subsystem, subsystem) != 0))
+    {
+        i = (i+1) & (DEVICE_INDEX_SIZE-1);
+    }
+    return &device_index[i];
+}
+
+struct device *find_device(struct device *devices, const char *subsystem,
+                           const char *name)
+{
+    int *slot = device_index_slot(devices, subsystem, name);
+    return *slot ? &devices[*slot-1] : NULL;
+}
+
+void rebuild_device_index(struct device *devices, int num_devices) {
+    memset(device_index, 0, sizeof(device_index));
+    for (int i = 0; i < num_devices; i++) {
+        *device_index_slot(devices, devices[i].subsystem, devices[i].name) = i+1;
+    }
+}
+
+// Split a device argument of the form [backlight/|leds/|ddc/]NAME. A bare
+// name is a backlight, unless only an LED of that name exists. Returns -1
+// if the class is unknown.
+int parse_device_name(const char *arg, const char **subsystem, const char **name) {
+    char path[PATH_MAX];
+    const char *slash = strchr(arg, '/');
+    if (slash) {
+        size_t len = slash - arg;
+        if (len == strlen("backlight") && strncmp(arg, "backlight", len) == 0) {
+            *subsystem = "backlight";
+        } else if (len == strlen("leds") && strncmp(arg, "leds", len) == 0) {
+            *subsystem = "leds";
+        } else if (len == strlen("ddc") && strncmp(arg, "ddc", len) == 0) {
+#ifdef WITH_DDC
+            *subsystem = "ddc";
+#else
+            LOG_ERROR("This build doesn't support DDC/CI devices\n");
+            return -1;
+#endif
+        } else {
+            LOG_ERROR("Unknown device class in %s\n", arg);
+            return -1;
+        }
+        *name = slash+1;
+        return 0;
+    }
+    *subsystem = "backlight";
+    *name = arg;
+    snprintf(path, sizeof(path), "/sys/class/backlight/%s", arg);
+    if (access(path, F_OK) == 0) return 0;
+    snprintf(path, sizeof(path), "/sys/class/leds/%s", arg);
+    if (access(path, F_OK) == 0) *subsystem = "leds";
+    return 0;
+}
+
+// Note that this may move the device list, so it must not be called while
+// method calls which point into it are in flight. subsystem must be a
+// string literal, as it is kept by reference.
+struct device *add_device(struct device **devices, int *num_devices,
+                          const char *subsystem, const char *name)
+{
+    if (strlen(name) > NAME_MAX || name[0] == '\0' || strchr(name, '/')) {
+        LOG_ERROR("Invalid device name %s\n", name);
+        return NULL;
+    }
+    struct device *dev = find_device(*devices, subsystem, name);
+    if (dev) return dev;
+    // Keep the index at most half full so that probe sequences stay short
+    if (*num_devices >= DEVICE_INDEX_SIZE/2) {
+        LOG_ERROR("Too many devices\n");
+        return NULL;
+    }
+    struct device *new_devices = realloc(*devices, (*num_devices+1) * sizeof(**devices));
+    if (!new_devices) {
+        perror("realloc");
+        return NULL;
+    }
+    *devices = new_devices;
+    dev = &new_devices[(*num_devices)++];
+    memset(dev, 0, sizeof(*dev));
+    strcpy(dev->name, name);
+    dev->subsystem = subsystem;
+    dev->lock_fd = -1;
+    dev->actual_fd = -1;
+#ifdef WITH_SYSFS
+    dev->brightness_fd = -1;
+#endif
+#ifdef WITH_DDC
+    dev->ddc_fd = -1;
+    dev->ddc_cache_fd = -1;
+    dev->ddc_pending = -1;
+#endif
+    *device_index_slot(new_devices, subsystem, name) = *num_devices;
+    return dev;
+}
+
+// Add each device in a comma separated list
+int add_device_list(struct device **devices, int *num_devices, const char *list) {
+    char arg[NAME_MAX+sizeof("backlight/")];
+    const char *subsystem, *name;
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        if (len > sizeof(arg)-1) {
+            LOG_ERROR("Device name is too long\n");
+            return -1;
+        }
+        memcpy(arg, list, len);
+        arg[len] = '\0';
+        if (parse_device_name(arg, &subsystem, &name) < 0
+            || !add_device(devices, num_devices, subsystem, name))
+        {
+            return -1;
+        }
+        list += len;
+        if (*list == ',') list++;
+    }
+    return 0;
+}
+
+int get_all_devices(const char *preference, struct device **devices,
+                    int *num_devices)
+{
+    struct candidate *candidates;
+    int num_candidates;
+    if (scan_devices(preference, &candidates, &num_candidates) < 0) return -1;
+    for (int i = 0; i < num_candidates; i++) {
+        if (!add_device(devices, num_devices, "backlight", candidates[i].name)) {
+            free(candidates);
+            return -1;
+        }
+    }
+    free(candidates);
+    return 0;
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Add the keyboard backlights, which the leds class names
+// <devicename>::kbd_backlight, in order of name
+int get_keyboard_devices(struct device **devices, int *num_devices) {
+    static const char *dir = "/sys/class/leds/";
+    char **names = NULL;
+    int num_names = 0, status = 0;
+    DIR *dp = opendir(dir);
+    if (!dp) {
+        LOG_ERROR("Error opening directory %s\n", dir);
+        return -1;
+    }
+    struct dirent *ep;
+    while ((ep = readdir(dp))) {
+        if (ep->d_name[0] == '.' || !strstr(ep->d_name, "kbd_backlight")) continue;
+        char **new_names = realloc(names, (num_names+1) * sizeof(*names));
+        if (!new_names || !(new_names[num_names] = strdup(ep->d_name))) {
+            perror("realloc");
+            names = new_names ? new_names : names;
+            status = -1;
+            break;
+        }
+        names = new_names;
+        num_names++;
+    }
+    closedir(dp);
+    if (status == 0 && num_names == 0) {
+        LOG_ERROR("No keyboard backlight found in %s\n", dir);
+        status = -1;
+    }
+    qsort(names, num_names, sizeof(*names), compare_names);
+    for (int i = 0; i < num_names; i++) {
+        if (status == 0 && !add_device(devices, num_devices, "leds", names[i])) {
+            status = -1;
+        }
+        free(names[i]);
+    }
+    free(names);
+    return status;
+}
+
+// The name of a device's file in XDG_RUNTIME_DIR. Only devices of other
+// classes than backlight have theirs in the name, so the files of
+// backlights are named as they always were.
+int get_runtime_name(const struct device *dev, const char *suffix,
+                     char *buf, size_t size)
+{
+    bool backlight = strcmp(dev->subsystem, "backlight") == 0;
+    int len = snprintf(buf, size, "backlight-dbus-%s%s%s.%s",
+                       backlight ? "" : dev->subsystem, backlight ? "" : "-",
+                       dev->name, suffix);
+    return len > (int)size-1 ? -1 : 0;
+}
+
+int get_runtime_path(const struct device *dev, const char *suffix,
+                     char *buf, size_t size)
+{
+    char name[NAME_MAX+32];
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (!runtime_dir) {
+        LOG_ERROR("XDG_RUNTIME_DIR is not set\n");
+        return -1;
+    }
+    if (get_runtime_name(dev, suffix, name, sizeof(name)) < 0
+        || snprintf(buf, size, "%s/%s", runtime_dir, name) > (int)size-1)
+    {
+        LOG_ERROR("File path is too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef WITH_DDC
+// Monitors are set over DDC/CI by writing VCP feature 0x10 (luminance)
+// through /dev/i2c-N. Each command is a message from the host with a
+// length byte and an XOR checksum which includes the display's address.
+bool is_ddc(const struct device *dev) {
+    return strcmp(dev->subsystem, "ddc") == 0;
+}
+
+int64_t fade_clock_nanos(void) {
+    struct timespec ts;
+    clock_gettime(fade_clock, &ts);
+    return ts.tv_sec * NANOSEC_PER_SEC + ts.tv_nsec;
+}
+
+// What other instances need to know about a monitor: its last known
+// luminance, so that each invocation doesn't have to ask for it, and when
+// it takes the next command, so that their commands are paced too. Times
+// are on CLOCK_BOOTTIME.
+struct ddc_cache {
+    int32_t value;
+    int32_t max_brightness;
+    int64_t cached_nanos;
+    int64_t ready_nanos;
+};
+
+// The offset from CLOCK_BOOTTIME to fade_clock
+int64_t ddc_clock_offset(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return fade_clock_nanos() - (ts.tv_sec * NANOSEC_PER_SEC + ts.tv_nsec);
+}
+
+// Take over whatever other instances have learned about the monitor since
+void ddc_load_cache(struct device *dev) {
+    struct ddc_cache cache;
+    if (dev->ddc_cache_fd < 0
+        || pread(dev->ddc_cache_fd, &cache, sizeof(cache), 0) != sizeof(cache))
+    {
+        return;
+    }
+    int64_t offset = ddc_clock_offset();
+    if (cache.ready_nanos + offset > dev->ddc_ready_nanos) {
+        dev->ddc_ready_nanos = cache.ready_nanos + offset;
+    }
+    if (cache.cached_nanos + offset > dev->ddc_cached_nanos && cache.max_brightness > 0) {
+        dev->ddc_value = cache.value;
+        dev->ddc_max = cache.max_brightness;
+        dev->ddc_cached_nanos = cache.cached_nanos + offset;
+    }
+}
+
+void ddc_save_cache(struct device *dev) {
+    int64_t offset = ddc_clock_offset();
+    struct ddc_cache cache = {
+        .value = dev->ddc_value,
+        .max_brightness = dev->ddc_max,
+        .cached_nanos = dev->ddc_cached_nanos - offset,
+        .ready_nanos = dev->ddc_ready_nanos - offset,
+    };
+    if (dev->ddc_cache_fd >= 0) {
+        pwrite(dev->ddc_cache_fd, &cache, sizeof(cache), 0);
+    }
+}
+
+// Sleep until a time on fade_clock. The waits for a monitor are short, so
+// this doesn't return early for signals.
+void sleep_until_nanos(int64_t t) {
+    struct timespec ts = {t / NANOSEC_PER_SEC, t % NANOSEC_PER_SEC};
+    while (clock_nanosleep(fade_clock, TIMER_ABSTIME, &ts, NULL) == EINTR) ;
+}
+
+// Take a monitor for one command: wait until no other instance is talking
+// to it and it is ready. The cache file stays locked until ddc_release(),
+// so that two instances can't both find the monitor ready and write to it
+// back to back.
+void ddc_acquire(struct device *dev) {
+    if (dev->ddc_cache_fd >= 0) {
+        while (flock(dev->ddc_cache_fd, LOCK_EX) < 0 && errno == EINTR) ;
+    }
+    ddc_load_cache(dev);
+    sleep_until_nanos(dev->ddc_ready_nanos);
+}
+
+// Start the monitor's inter-command delay and let other instances at it
+void ddc_release(struct device *dev) {
+    dev->ddc_ready_nanos = fade_clock_nanos()
+                           + ddc_delay_millis * NANOSEC_PER_MILLISEC;
+    ddc_save_cache(dev);
+    if (dev->ddc_cache_fd >= 0) flock(dev->ddc_cache_fd, LOCK_UN);
+}
+
+// Open the I2C bus of a monitor. A unix socket in place of the device node
+// stands in for a monitor, e.g. for testing; it gets each transfer as one
+// packet.
+int ddc_open(struct device *dev) {
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+    if (dev->ddc_fd >= 0) return 0;
+    snprintf(path, sizeof(path), "/dev/%s", dev->name);
+    if (stat(path, &st) < 0) {
+        fd = -1;
+    } else if (S_ISSOCK(st.st_mode)) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            LOG_ERROR("File path is too long\n");
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+        fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd >= 0 && ioctl(fd, I2C_SLAVE, DDC_I2C_ADDRESS) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        LOG_ERROR("Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    dev->ddc_fd = fd;
+    if (getenv("XDG_RUNTIME_DIR")
+        && get_runtime_path(dev, "cache", path, sizeof(path)) == 0)
+    {
+        dev->ddc_cache_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    }
+    return 0;
+}
+
+int ddc_send(struct device *dev, const unsigned char *payload, int len) {
+    unsigned char buf[8];
+    unsigned char checksum = DDC_I2C_ADDRESS << 1;
+    buf[0] = DDC_HOST_ADDRESS;
+    buf[1] = 0x80 | len;
+    memcpy(buf+2, payload, len);
+    for (int i = 0; i < len+2; i++) {
+        checksum ^= buf[i];
+    }
+    buf[len+2] = checksum;
+    if (write(dev->ddc_fd, buf, len+3) != len+3) {
+        LOG_ERROR("DDC/CI write to %s failed: %s\n", dev->name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Take the luminance out of a reply of the monitor. Returns 1 if the reply
+// isn't valid, as when the monitor wasn't ready.
+int ddc_parse_reply(struct device *dev, const unsigned char *reply, ssize_t n) {
+    // The reply's checksum is calculated with the host's address
+    unsigned char checksum = 0x50;
+    for (int i = 0; i < n-1; i++) {
+        checksum ^= reply[i];
+    }
+    if (n != 11 || reply[1] != (0x80 | 8) || reply[2] != 0x02
+        || reply[4] != DDC_VCP_BRIGHTNESS || reply[10] != checksum)
+    {
+        LOG_INFO("Invalid DDC/CI reply from %s\n", dev->name);
+        return 1;
+    }
+    int max_brightness = reply[6] << 8 | reply[7];
+    if (reply[3] != 0 || max_brightness <= 0) {
+        LOG_ERROR("%s doesn't support brightness over DDC/CI\n", dev->name);
+        return -1;
+    }
+    dev->ddc_max = max_brightness;
+    dev->ddc_value = reply[8] << 8 | reply[9];
+    dev->ddc_cached_nanos = fade_clock_nanos();
+    return 0;
+}
+
+// Ask the monitor for its luminance. A monitor which isn't ready answers
+// with a null message or garbage, in which case the request is repeated.
+// The monitor stays locked until the reply is in the cache, so that
+// another instance's cache update can't overtake it.
+int ddc_get_brightness(struct device *dev) {
+    static const unsigned char request[] = {0x01, DDC_VCP_BRIGHTNESS};
+    for (int attempt = 0; attempt < DDC_READ_ATTEMPTS; attempt++) {
+        unsigned char reply[11];
+        int status = -1;
+        ddc_acquire(dev);
+        if (ddc_send(dev, request, sizeof(request)) == 0) {
+            sleep_until_nanos(fade_clock_nanos()
+                              + DDC_REPLY_DELAY_MILLIS * NANOSEC_PER_MILLISEC);
+            ssize_t n = read(dev->ddc_fd, reply, sizeof(reply));
+            if (n < 0) {
+                LOG_ERROR("DDC/CI read from %s failed: %s\n", dev->name,
+                          strerror(errno));
+            } else {
+                status = ddc_parse_reply(dev, reply, n);
+            }
+        }
+        ddc_release(dev);
+        if (status <= 0) return status;
+    }
+    LOG_ERROR("No valid DDC/CI reply from %s\n", dev->name);
+    return -1;
+}
+
+int ddc_read_brightness(struct device *dev, int *cur_brightness,
+                        int *max_brightness)
+{
+    if (ddc_open(dev) < 0) return -1;
+    ddc_load_cache(dev);
+    if (!dev->ddc_cached_nanos || fade_clock_nanos() - dev->ddc_cached_nanos
+                                  > DDC_CACHE_MILLIS * NANOSEC_PER_MILLISEC)
+    {
+        if (ddc_get_brightness(dev) < 0) return -1;
+    }
+    *cur_brightness = dev->ddc_value;
+    *max_brightness = dev->ddc_max;
+    return 0;
+}
+
+int ddc_write_brightness(struct device *dev, int brightness) {
+    unsigned char command[] = {0x03, DDC_VCP_BRIGHTNESS, brightness >> 8,
+                               brightness & 0xff};
+    ddc_acquire(dev);
+    int status = ddc_send(dev, command, sizeof(command));
+    if (status == 0) {
+        dev->ddc_value = brightness;
+        dev->ddc_cached_nanos = fade_clock_nanos();
+    }
+    ddc_release(dev);
+    if (status < 0) {
+        dev->failed = true;
+        return status;
+    }
+    return 0;
+}
+#endif
+
+int read_brightness(struct device *dev, int *cur_brightness,
                     int *max_brightness)
 {
+#ifdef WITH_DDC
+    if (is_ddc(dev)) return ddc_read_brightness(dev, cur_brightness, max_brightness);
+#endif
     char dir[PATH_MAX];
-    int size = snprintf(dir, sizeof(dir), "/sys/class/backlight/%s/", device_name);
+    int size = snprintf(dir, sizeof(dir), "/sys/class/%s/%s/",
+                        dev->subsystem, dev->name);
     if (size > (int)sizeof(dir)-1) {
         LOG_ERROR("File path is too long\n");
         return -1;
@@ -176,7 +1005,7 @@ int calculate_target_brightness(
     } else if (prefix == '+') {
         brightness = cur_brightness + brightness;
     }
-    if (brightness > max_brightness) {
+    if (brightness < 0 || brightness > max_brightness) {
         LOG_ERROR("Brightness is out of range\n");
         return -1;
     }
@@ -220,52 +1049,254 @@ int timespec_diff_in_millis(const struct timespec *a, const struct timespec *b)
     return sec_diff * MILLISEC_PER_SEC + nsec_diff / NANOSEC_PER_MILLISEC;
 }
 
-int setup_signal_handler(void) {
-    struct sigaction act;
-    act.sa_handler = signal_handler;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = 0;
-    for (int i = 0; signals_to_catch[i] != 0; i++) {
-        if (sigaction(signals_to_catch[i], &act, NULL) < 0) {
-            perror("sigaction");
-            return -1;
-        }
+double timespec_to_sec(const struct timespec *ts) {
+    return ts->tv_sec + (double)ts->tv_nsec / NANOSEC_PER_SEC;
+}
+
+#ifdef WITH_DAEMON
+void spring_init(struct spring *s, double t, double position) {
+    s->target = position;
+    s->offset = 0;
+    s->velocity = 0;
+    s->omega = 0;
+    s->t0 = t;
+}
+
+void spring_state(const struct spring *s, double t, double *pos, double *vel) {
+    double dt = t - s->t0;
+    double a = s->velocity + s->omega * s->offset;
+    double decay = exp(-s->omega * dt);
+    *pos = s->target + (s->offset + a * dt) * decay;
+    *vel = (s->velocity - s->omega * a * dt) * decay;
+}
+
+// Move the spring's target while keeping its current position and velocity,
+// so that a fade which is already in progress bends smoothly towards the
+// new value instead of restarting.
+void spring_retarget(struct spring *s, double t, double target, float duration) {
+    double pos, vel;
+    spring_state(s, t, &pos, &vel);
+    s->target = target;
+    s->t0 = t;
+    if (duration <= 0) {
+        s->offset = 0;
+        s->velocity = 0;
+        s->omega = 0;
+    } else {
+        s->offset = pos - target;
+        s->velocity = vel;
+        s->omega = SPRING_SETTLE_FACTOR / duration;
+    }
+}
+
+// The spring only approaches its target asymptotically, so consider it
+// done once the requested duration has passed or it is within half a level
+bool spring_settled(const struct spring *s, double t, int steps_per_sec) {
+    double pos, vel;
+    if ((t - s->t0) * s->omega >= SPRING_SETTLE_FACTOR) return true;
+    spring_state(s, t, &pos, &vel);
+    return fabs(pos - s->target) < 0.5 && fabs(vel) / steps_per_sec < 0.5;
+}
+#endif
+
+int read_steps_per_sec(const char *s, int *res) {
+    char *endptr;
+    long l = strtol(s, &endptr, 10);
+    if (endptr == s || *endptr != '\0' || l < 1 || l > MAX_STEPS_PER_SEC) {
+        LOG_ERROR("Invalid value for rate (must be between 1 and %d)\n",
+                  MAX_STEPS_PER_SEC);
+        return -1;
     }
+    *res = l;
     return 0;
 }
 
-void initialize_signals_to_catch_set(void) {
-    sigset_t *set = &signals_to_catch_set;
-    sigemptyset(set);
-    for (int i = 0; signals_to_catch[i] != 0; i++) {
-        sigaddset(set, signals_to_catch[i]);
+int read_jnd(const char *s, float *res) {
+    char *endptr;
+    float f = strtof(s, &endptr);
+    if (endptr == s || *endptr != '\0' || f < 0 || f >= 100) {
+        LOG_ERROR("Invalid value for JND percentage\n");
+        return -1;
     }
+    *res = f;
+    return 0;
 }
 
-int block_signals(void) {
-    if (sigprocmask(SIG_BLOCK, &signals_to_catch_set, NULL) < 0) {
-        perror("sigprocmask");
+#ifdef WITH_KEYS
+int read_key_step(const char *s, float *res) {
+    char *endptr;
+    float f = strtof(s, &endptr);
+    if (endptr == s || *endptr != '\0' || f <= 0 || f > 100) {
+        LOG_ERROR("Invalid value for key step percentage\n");
         return -1;
     }
+    *res = f;
     return 0;
 }
+#endif
 
-int unblock_signals(void) {
-    if (sigprocmask(SIG_UNBLOCK, &signals_to_catch_set, NULL) < 0) {
-        perror("sigprocmask");
+#ifdef WITH_DDC
+int read_ddc_delay(const char *s, int *res) {
+    char *endptr;
+    long l = strtol(s, &endptr, 10);
+    if (endptr == s || *endptr != '\0' || l < 0 || l > MAX_DDC_DELAY_MILLIS) {
+        LOG_ERROR("Invalid value for DDC/CI delay (must be between 0 and %d)\n",
+                  MAX_DDC_DELAY_MILLIS);
         return -1;
     }
+    *res = l;
     return 0;
 }
+#endif
 
-int set_brightness(
-        sd_bus *bus, const char *session_object_path, sd_bus_error *error,
-        const char *device_name, int brightness)
-{
-    // For some reason the DBus library doesn't seem to be able to
-    // send messages anymore once it gets interrupted by one of the
-    // termination signals. This is a problem for us because we want to
-    // restore the original brightness after such a signal is received.
+int read_sched_policy(const char *s, int *res) {
+    if (strcmp(s, "fifo") == 0) {
+        *res = SCHED_FIFO;
+    } else if (strcmp(s, "rr") == 0) {
+        *res = SCHED_RR;
+    } else {
+        LOG_ERROR("Invalid value for --low-jitter (must be fifo or rr)\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Make fade steps wake up on time under load: with little timer slack the
+// kernel doesn't defer our wakeups to batch them with others, locked
+// memory can't fault, and a realtime policy keeps ordinary processes from
+// running first. Each of these is best effort, since the latter two
+// usually need privileges or raised limits.
+void enter_low_jitter(int policy) {
+    if (prctl(PR_SET_TIMERSLACK, LOW_JITTER_TIMER_SLACK_NANOS) < 0) {
+        LOG_ERROR("Could not set timer slack: %s\n", strerror(errno));
+    }
+    if (policy != SCHED_OTHER) {
+        struct sched_param param = {.sched_priority = LOW_JITTER_PRIORITY};
+        if (sched_setscheduler(0, policy, &param) < 0) {
+            LOG_ERROR("Could not set realtime scheduling policy: %s\n",
+                      strerror(errno));
+        }
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        LOG_ERROR("Could not lock memory: %s\n", strerror(errno));
+    }
+}
+
+int read_clock(const char *s, clockid_t *res) {
+    if (strcmp(s, "boottime") == 0) {
+        *res = CLOCK_BOOTTIME;
+    } else if (strcmp(s, "monotonic") == 0) {
+        *res = CLOCK_MONOTONIC;
+    } else {
+        LOG_ERROR("Invalid value for --clock (must be boottime or monotonic)\n");
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef WITH_DBUS
+int read_sleep_policy(const char *s, enum sleep_policy *res) {
+    if (strcmp(s, "ignore") == 0) {
+        *res = SLEEP_IGNORE;
+    } else if (strcmp(s, "pause") == 0) {
+        *res = SLEEP_PAUSE;
+    } else if (strcmp(s, "continue") == 0) {
+        *res = SLEEP_CONTINUE;
+    } else if (strcmp(s, "complete") == 0) {
+        *res = SLEEP_COMPLETE;
+    } else {
+        LOG_ERROR("Invalid value for --on-sleep "
+                  "(must be pause, continue, complete or ignore)\n");
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+int read_external_policy(const char *s, enum external_policy *res) {
+    if (strcmp(s, "ignore") == 0) {
+        *res = EXTERNAL_IGNORE;
+    } else if (strcmp(s, "abort") == 0) {
+        *res = EXTERNAL_ABORT;
+    } else if (strcmp(s, "retarget") == 0) {
+        *res = EXTERNAL_RETARGET;
+    } else {
+        LOG_ERROR("Invalid value for --on-external (must be abort, retarget or ignore)\n");
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef WITH_MIRROR
+int read_curve(const char *s, float *res) {
+    char *endptr;
+    float f = strtof(s, &endptr);
+    if (endptr == s || *endptr != '\0' || f <= 0) {
+        LOG_ERROR("Invalid value for curve exponent\n");
+        return -1;
+    }
+    *res = f;
+    return 0;
+}
+#endif
+
+// Brightness perception roughly follows Weber's law, so whether a step is
+// visible depends on its size relative to the brighter of the two levels.
+// A JND of 0 accepts every change.
+bool is_perceptible_step(int from, int to, float jnd_percent) {
+    int diff = abs(to - from);
+    int base = from > to ? from : to;
+    if (diff == 0) return false;
+    return diff * 100.0f >= jnd_percent * base;
+}
+
+int setup_signal_handler(void) {
+    struct sigaction act;
+    act.sa_handler = signal_handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    for (int i = 0; signals_to_catch[i] != 0; i++) {
+        if (sigaction(signals_to_catch[i], &act, NULL) < 0) {
+            perror("sigaction");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void initialize_signals_to_catch_set(void) {
+    sigset_t *set = &signals_to_catch_set;
+    sigemptyset(set);
+    for (int i = 0; signals_to_catch[i] != 0; i++) {
+        sigaddset(set, signals_to_catch[i]);
+    }
+}
+
+int block_signals(void) {
+    if (sigprocmask(SIG_BLOCK, &signals_to_catch_set, NULL) < 0) {
+        perror("sigprocmask");
+        return -1;
+    }
+    return 0;
+}
+
+int unblock_signals(void) {
+    if (sigprocmask(SIG_UNBLOCK, &signals_to_catch_set, NULL) < 0) {
+        perror("sigprocmask");
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef WITH_DBUS
+int set_brightness(
+        sd_bus *bus, const char *session_object_path, sd_bus_error *error,
+        const struct device *dev, int brightness)
+{
+    // For some reason the DBus library doesn't seem to be able to
+    // send messages anymore once it gets interrupted by one of the
+    // termination signals. This is a problem for us because we want to
+    // restore the original brightness after such a signal is received.
     // So we will block those signals when sending a message.
     block_signals();
     int ret = sd_bus_call_method(bus,
@@ -276,41 +1307,3443 @@ int set_brightness(
                               error,
                               NULL,
                               "ssu",
-                              "backlight",
-                              device_name,
+                              dev->subsystem,
+                              dev->name,
                               (unsigned int)brightness);
     unblock_signals();
     return ret;
 }
 
+int get_session_by_id(sd_bus *bus, const char *session_id, char **result) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *get_session_msg = NULL;
+    int status = sd_bus_call_method(
+        bus,
+        "org.freedesktop.login1",
+        "/org/freedesktop/login1",
+        "org.freedesktop.login1.Manager",
+        "GetSession",
+        &error,
+        &get_session_msg,
+        "s",
+        session_id);
+    if (status < 0) {
+        log_method_call_failed(&error);
+        sd_bus_error_free(&error);
+        return status;
+    }
+    // Parse the response message
+    char *session_object_path = NULL;
+    status = sd_bus_message_read(get_session_msg, "o", &session_object_path);
+    if (status >= 0) {
+        *result = strdup(session_object_path);
+    }
+    sd_bus_message_unref(get_session_msg);
+    if (status < 0) {
+        log_parse_failed(status);
+        return status;
+    }
+    return 0;
+}
+
+bool is_active_graphical_session(sd_bus *bus, const char *path) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    int active = 0;
+    char *type = NULL;
+    if (sd_bus_get_property_trivial(bus, "org.freedesktop.login1", path,
+                                    "org.freedesktop.login1.Session", "Active",
+                                    &error, 'b', &active) < 0
+        || sd_bus_get_property_string(bus, "org.freedesktop.login1", path,
+                                      "org.freedesktop.login1.Session", "Type",
+                                      &error, &type) < 0)
+    {
+        sd_bus_error_free(&error);
+        return false;
+    }
+    bool graphical = strcmp(type, "x11") == 0 || strcmp(type, "wayland") == 0
+                     || strcmp(type, "mir") == 0;
+    free(type);
+    return active && graphical;
+}
+
+// Look for an active graphical session belonging to our user. Returns 1 if
+// one was found, 0 if not.
+int find_graphical_session(sd_bus *bus, char **result) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    const char *id, *user, *seat, *path;
+    uint32_t uid;
+    int found = 0;
+    int status = sd_bus_call_method(
+        bus,
+        "org.freedesktop.login1",
+        "/org/freedesktop/login1",
+        "org.freedesktop.login1.Manager",
+        "ListSessions",
+        &error,
+        &reply,
+        NULL);
+    if (status < 0) {
+        log_method_call_failed(&error);
+        sd_bus_error_free(&error);
+        return status;
+    }
+    status = sd_bus_message_enter_container(reply, 'a', "(susso)");
+    while (status >= 0
+           && (status = sd_bus_message_read(reply, "(susso)", &id, &uid,
+                                            &user, &seat, &path)) > 0)
+    {
+        if (uid != getuid()) continue;
+        LOG_INFO("Checking session %s\n", id);
+        if (is_active_graphical_session(bus, path)) {
+            *result = strdup(path);
+            found = 1;
+            break;
+        }
+    }
+    sd_bus_message_unref(reply);
+    if (status < 0) {
+        log_parse_failed(status);
+        return status;
+    }
+    return found;
+}
+
+// Ask logind for the session path: by ID if we have one, or else an active
+// graphical session of ours found with ListSessions. The latter is cached
+// for the rest of the boot.
+int resolve_session_path(sd_bus *bus, const char *session_id, char **result) {
+    int status;
+    if (session_id) {
+        return get_session_by_id(bus, session_id, result);
+    }
+    LOG_INFO("XDG_SESSION_ID not set, looking for a graphical session\n");
+    status = find_graphical_session(bus, result);
+    if (status <= 0) {
+        LOG_INFO("No graphical session found, using auto session instead\n");
+        *result = strdup("/org/freedesktop/login1/session/auto");
+        return 0;
+    }
+    write_cache("session", "-", *result);
+    return 0;
+}
+
+// The session is the one given with -x, or else XDG_SESSION_ID, or else one
+// found by resolve_session_path(). logind's object path for a session is
+// just the escaped ID, so in the first two cases no round trip is needed.
+int get_session_path(sd_bus *bus, struct session *session) {
+    char cached_path[CACHE_VALUE_MAX+1];
+    if (session->id) {
+        LOG_INFO("Using session ID %s\n", session->id);
+    } else if ((session->id = getenv("XDG_SESSION_ID"))) {
+        LOG_INFO("Found XDG_SESSION_ID=%s\n", session->id);
+    }
+    if (session->id) {
+        int status = sd_bus_path_encode("/org/freedesktop/login1/session",
+                                        session->id, &session->path);
+        if (status < 0) {
+            LOG_ERROR("Failed to encode session path: %s\n", strerror(-status));
+        }
+        return status;
+    }
+    if (read_cache("session", "-", cached_path)) {
+        LOG_INFO("Using cached session path\n");
+        session->path = strdup(cached_path);
+        return 0;
+    }
+    session->verified = true;
+    return resolve_session_path(bus, NULL, &session->path);
+}
+
+// Set the brightness synchronously. If the session path hasn't been
+// confirmed yet and logind doesn't know it, look it up properly and retry.
+int set_brightness_checked(sd_bus *bus, struct session *session,
+                           sd_bus_error *error, const struct device *dev,
+                           int brightness)
+{
+    int ret = set_brightness(bus, session->path, error, dev, brightness);
+    if (ret < 0 && !session->verified
+        && sd_bus_error_has_name(error, SD_BUS_ERROR_UNKNOWN_OBJECT))
+    {
+        char *path;
+        LOG_INFO("Session path %s is unknown, asking logind\n", session->path);
+        sd_bus_error_free(error);
+        clear_cache("session");
+        session->verified = true;
+        ret = resolve_session_path(bus, session->id, &path);
+        if (ret < 0) {
+            return ret;
+        }
+        free(session->path);
+        session->path = path;
+        LOG_INFO("Session object path: %s\n", session->path);
+        ret = set_brightness(bus, session->path, error, dev, brightness);
+    }
+    if (ret >= 0) {
+        if (!session->verified) {
+            profile_mark("first SetBrightness returned");
+        }
+        session->verified = true;
+    }
+    return ret;
+}
+
+// A cached session path stops working once the session ends
+void check_stale_session(const sd_bus_error *error) {
+    if (sd_bus_error_has_name(error, SD_BUS_ERROR_UNKNOWN_OBJECT)) {
+        LOG_INFO("Session object is gone, forgetting cached path\n");
+        clear_cache("session");
+    }
+}
+
+// Connect to the system bus. Unlike sd_bus_open_system(), this doesn't
+// negotiate fd passing or credentials, which we never use, to keep the
+// handshake short.
+int connect_system_bus(sd_bus **res) {
+    const char *address = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+    sd_bus *bus = NULL;
+    int status = sd_bus_new(&bus);
+    if (status >= 0) {
+        status = sd_bus_set_address(
+            bus, address ? address : "unix:path=/run/dbus/system_bus_socket");
+    }
+    if (status >= 0) status = sd_bus_set_bus_client(bus, 1);
+    if (status >= 0) status = sd_bus_negotiate_fds(bus, 0);
+    if (status >= 0) status = sd_bus_negotiate_creds(bus, 0, 0);
+    if (status >= 0) status = sd_bus_start(bus);
+    if (status < 0) {
+        sd_bus_unref(bus);
+        return status;
+    }
+    *res = bus;
+    return 0;
+}
+
+// Work out the session path, connecting to the system bus first unless
+// that was already started
+int open_bus(sd_bus **bus, struct session *session) {
+    int status;
+    if (!*bus) {
+        status = connect_system_bus(bus);
+        if (status < 0) {
+            LOG_ERROR("Failed to connect to systemd bus: %s\n", strerror(-status));
+            return status;
+        }
+    }
+    status = get_session_path(*bus, session);
+    if (status < 0) {
+        return status;
+    }
+    LOG_INFO("Session object path: %s\n", session->path);
+    profile_mark("session path known");
+    return 0;
+}
+
+int set_brightness_done(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    struct device *dev = userdata;
+    const sd_bus_error *error = sd_bus_message_get_error(m);
+    dev->call_pending = false;
+    if (error) {
+        LOG_ERROR("%s: ", dev->name);
+        log_method_call_failed(error);
+        check_stale_session(error);
+        dev->failed = true;
+    }
+    return 0;
+}
+
+// Like set_brightness(), but doesn't wait for the reply; the result is
+// collected by set_brightness_done() while the bus is processed
+int set_brightness_async(sd_bus *bus, struct session *session,
+                         struct device *dev, int brightness)
+{
+    if (!session->verified) {
+        // The first call is made synchronously, so that a wrong session
+        // path can be fixed before anything else is sent
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        int ret = set_brightness_checked(bus, session, &error, dev, brightness);
+        if (ret < 0) {
+            LOG_ERROR("%s: ", dev->name);
+            log_method_call_failed(&error);
+            sd_bus_error_free(&error);
+            dev->failed = true;
+            return ret;
+        }
+        dev->cur_brightness = brightness;
+        return 0;
+    }
+    block_signals();
+    int ret = sd_bus_call_method_async(bus,
+                                       NULL,
+                                       "org.freedesktop.login1",
+                                       session->path,
+                                       "org.freedesktop.login1.Session",
+                                       "SetBrightness",
+                                       set_brightness_done,
+                                       dev,
+                                       "ssu",
+                                       dev->subsystem,
+                                       dev->name,
+                                       (unsigned int)brightness);
+    unblock_signals();
+    if (ret < 0) {
+        LOG_ERROR("Failed to issue method call: %s\n", strerror(-ret));
+        dev->failed = true;
+        return ret;
+    }
+    dev->call_pending = true;
+    dev->cur_brightness = brightness;
+    return 0;
+}
+
+int process_bus(sd_bus *bus) {
+    int ret;
+    block_signals();
+    while ((ret = sd_bus_process(bus, NULL)) > 0) ;
+    unblock_signals();
+    if (ret < 0) {
+        LOG_ERROR("Failed to process bus: %s\n", strerror(-ret));
+    }
+    return ret;
+}
+
+// Dispatch replies until the deadline (on fade_clock) or a signal arrives
+int process_bus_until(sd_bus *bus, const struct timespec *deadline) {
+    struct timespec now;
+    while (!received_signal && !interrupted) {
+        if (process_bus(bus) < 0) return -1;
+        clock_gettime(fade_clock, &now);
+        if (timespec_cmp(&now, deadline) >= 0) return 0;
+        uint64_t usec = (deadline->tv_sec - now.tv_sec) * 1000000LL
+                        + (deadline->tv_nsec - now.tv_nsec) / 1000;
+        int ret = sd_bus_wait(bus, usec);
+        if (ret < 0 && ret != -EINTR) {
+            LOG_ERROR("Failed to wait on bus: %s\n", strerror(-ret));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int wait_for_replies(sd_bus *bus, struct device *devices, int num_devices) {
+    for (;;) {
+        if (process_bus(bus) < 0) return -1;
+        bool pending = false;
+        for (int i = 0; i < num_devices; i++) {
+            pending |= devices[i].call_pending;
+        }
+        if (!pending) return 0;
+        int ret = sd_bus_wait(bus, UINT64_MAX);
+        if (ret < 0 && ret != -EINTR) {
+            LOG_ERROR("Failed to wait on bus: %s\n", strerror(-ret));
+            return -1;
+        }
+    }
+}
+
+static enum sleep_policy on_sleep = SLEEP_IGNORE;
+// Between logind's PrepareForSleep(true) and PrepareForSleep(false)
+static bool going_to_sleep = false;
+
+int prepare_for_sleep(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    int start;
+    if (sd_bus_message_read(m, "b", &start) <= 0) return 0;
+    LOG_INFO("System %s\n", start ? "is going to sleep" : "has resumed");
+    going_to_sleep = start;
+    return 0;
+}
+
+// Subscribe to logind's sleep notifications. The bus is then processed
+// while waiting, even if no device is set through logind.
+int watch_sleep(struct backend *b) {
+    int ret;
+    if (!b->bus) {
+        ret = connect_system_bus(&b->bus);
+        if (ret < 0) {
+            LOG_ERROR("Failed to connect to systemd bus: %s\n", strerror(-ret));
+            b->bus = NULL;
+            return ret;
+        }
+    }
+    ret = sd_bus_match_signal(b->bus, NULL, "org.freedesktop.login1",
+                              "/org/freedesktop/login1",
+                              "org.freedesktop.login1.Manager", "PrepareForSleep",
+                              prepare_for_sleep, NULL);
+    if (ret < 0) {
+        LOG_ERROR("Failed to subscribe to sleep notifications: %s\n", strerror(-ret));
+        return ret;
+    }
+    b->watching_sleep = true;
+    return 0;
+}
+
+// Stop stepping until the system has resumed. Nothing but the bus is
+// waited on, so there are no wakeups in the meantime, and the first step
+// after resuming goes straight to where the fade should be by then. With
+// SLEEP_PAUSE, the time spent asleep is taken out of the fade.
+int hold_fade_for_sleep(struct backend *b, struct timespec *start_time,
+                        struct timespec *target_time)
+{
+    struct timespec before, after;
+    clock_gettime(fade_clock, &before);
+    LOG_INFO("Holding the fade\n");
+    while (going_to_sleep && !received_signal && !interrupted) {
+        int ret = sd_bus_wait(b->bus, UINT64_MAX);
+        if (ret < 0 && ret != -EINTR) {
+            LOG_ERROR("Failed to wait on bus: %s\n", strerror(-ret));
+            return -1;
+        }
+        if (process_bus(b->bus) < 0) return -1;
+    }
+    clock_gettime(fade_clock, &after);
+    if (on_sleep == SLEEP_PAUSE) {
+        long paused_nanos = (after.tv_sec - before.tv_sec) * NANOSEC_PER_SEC
+                            + (after.tv_nsec - before.tv_nsec);
+        add_nanoseconds_to_timespec(start_time, paused_nanos, start_time);
+        add_nanoseconds_to_timespec(target_time, paused_nanos, target_time);
+    }
+    return 0;
+}
+#endif
+
+// Open a sysfs attribute of a device, for polling or writing. Errors are
+// left to the caller to report.
+int open_attribute(const struct device *dev, const char *attribute, int flags) {
+    char path[PATH_MAX];
+    int size = snprintf(path, sizeof(path), "/sys/class/%s/%s/%s",
+                        dev->subsystem, dev->name, attribute);
+    if (size > (int)sizeof(path)-1) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return open(path, flags | O_CLOEXEC);
+}
+
+int read_attribute(int fd, int *res) {
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf)-1, 0);
+    if (n <= 0) {
+        LOG_ERROR("Error reading brightness attribute\n");
+        return -1;
+    }
+    buf[n] = '\0';
+    *res = strtol(buf, NULL, 10);
+    return 0;
+}
+
+#ifdef WITH_SYSFS
+int write_brightness(struct device *dev, int brightness) {
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%d", brightness);
+    if (pwrite(dev->brightness_fd, buf, len, 0) < 0) {
+        LOG_ERROR("Could not write brightness of %s: %s\n", dev->name, strerror(errno));
+        dev->failed = true;
+        return -1;
+    }
+    dev->cur_brightness = brightness;
+    return 0;
+}
+#endif
+
+#ifdef WITH_DDC
+// Mark a monitor busy until its inter-command delay is over. Returns false
+// if too many are busy already.
+bool ddc_mark_busy(struct backend *b, struct device *dev) {
+    if (dev->call_pending) return true;
+    if (b->num_ddc_busy == DDC_MAX_BUSY) return false;
+    b->ddc_busy[b->num_ddc_busy++] = dev;
+    dev->call_pending = true;
+    return true;
+}
+
+// Write to a monitor, or if it is still busy, hold the value back until it
+// is ready. Only the latest value held back is written. Returns 1 if the
+// value replaced one which was held back.
+int ddc_set(struct backend *b, struct device *dev, int brightness) {
+    int64_t now = fade_clock_nanos();
+    dev->cur_brightness = brightness;
+    if (dev->ddc_pending < 0) ddc_load_cache(dev);
+    if (now < dev->ddc_ready_nanos) {
+        if (dev->ddc_pending >= 0) {
+            dev->ddc_pending = brightness;
+            return 1;
+        }
+        if (ddc_mark_busy(b, dev)) {
+            dev->ddc_pending = brightness;
+            return 0;
+        }
+        sleep_until_nanos(dev->ddc_ready_nanos);
+    }
+    if (ddc_write_brightness(dev, brightness) < 0) return -1;
+    if (!ddc_mark_busy(b, dev)) {
+        sleep_until_nanos(dev->ddc_ready_nanos);
+    }
+    return 0;
+}
+
+// Write the values held back for monitors which are ready, and release the
+// monitors whose delay is over. With wait, sleep as long as it takes to
+// write every value held back, and release all monitors.
+void ddc_flush(struct backend *b, bool wait) {
+    int i = 0;
+    while (i < b->num_ddc_busy) {
+        struct device *dev = b->ddc_busy[i];
+        if (wait && dev->ddc_pending >= 0) {
+            sleep_until_nanos(dev->ddc_ready_nanos);
+        }
+        if (dev->ddc_pending >= 0 && fade_clock_nanos() >= dev->ddc_ready_nanos) {
+            int brightness = dev->ddc_pending;
+            dev->ddc_pending = -1;
+            ddc_write_brightness(dev, brightness);
+        }
+        if (dev->ddc_pending < 0
+            && (wait || fade_clock_nanos() >= dev->ddc_ready_nanos))
+        {
+            dev->call_pending = false;
+            b->ddc_busy[i] = b->ddc_busy[--b->num_ddc_busy];
+        } else {
+            i++;
+        }
+    }
+}
+
+// When the first busy monitor is ready. Returns false if none is busy.
+bool ddc_next_ready(struct backend *b, int64_t *res) {
+    for (int i = 0; i < b->num_ddc_busy; i++) {
+        if (i == 0 || b->ddc_busy[i]->ddc_ready_nanos < *res) {
+            *res = b->ddc_busy[i]->ddc_ready_nanos;
+        }
+    }
+    return b->num_ddc_busy > 0;
+}
+#endif
+
+// Decide how each device is set: monitors over DDC/CI, others directly if
+// their brightness attribute can be opened for writing (as root, or thanks
+// to a udev rule), or else through logind, in which case the bus is opened
+// too
+int backend_open(struct backend *b, struct device *devices, int num_devices) {
+#ifdef WITH_DBUS
+    bool need_bus = false;
+#endif
+    for (int i = 0; i < num_devices; i++) {
+        struct device *dev = &devices[i];
+#ifdef WITH_DDC
+        if (is_ddc(dev)) {
+            if (ddc_open(dev) < 0) return -1;
+            LOG_INFO("Setting %s through DDC/CI\n", dev->name);
+            continue;
+        }
+#endif
+#ifdef WITH_SYSFS
+        if (dev->brightness_fd >= 0) close(dev->brightness_fd);
+        dev->brightness_fd = open_attribute(dev, "brightness", O_WRONLY);
+        if (dev->brightness_fd >= 0) {
+            LOG_INFO("Setting %s through sysfs\n", dev->name);
+            continue;
+        }
+#endif
+#ifdef WITH_DBUS
+        LOG_INFO("Setting %s through logind\n", dev->name);
+        need_bus = true;
+#else
+        LOG_ERROR("Could not open brightness of %s for writing: %s\n",
+                  dev->name, strerror(errno));
+        return -1;
+#endif
+    }
+#ifdef WITH_DBUS
+    if (need_bus && !b->session.path) {
+        int status = open_bus(&b->bus, &b->session);
+        if (status < 0) return status;
+    }
+    if (on_sleep != SLEEP_IGNORE && !b->watching_sleep) {
+        return watch_sleep(b);
+    }
+#endif
+    return 0;
+}
+
+// Set a device's brightness. Calls through logind are only issued here;
+// their result arrives while the backend is processed. Returns 1 if the
+// value was merged into a DDC/CI write which hasn't been sent yet.
+int backend_set(struct backend *b, struct device *dev, int brightness) {
+#ifdef WITH_DDC
+    if (is_ddc(dev)) return ddc_set(b, dev, brightness);
+#endif
+#ifdef WITH_SYSFS
+    if (dev->brightness_fd >= 0) {
+        return write_brightness(dev, brightness);
+    }
+#endif
+#ifdef WITH_DBUS
+    return set_brightness_async(b->bus, &b->session, dev, brightness);
+#else
+    return -1;
+#endif
+}
+
+int backend_process(struct backend *b) {
+#ifdef WITH_DDC
+    ddc_flush(b, false);
+#endif
+#ifdef WITH_DBUS
+    if (b->session.path || b->watching_sleep) return process_bus(b->bus);
+#endif
+    return 0;
+}
+
+int wait_for_deadline(struct backend *b, const struct timespec *deadline) {
+#ifdef WITH_DBUS
+    if (b->session.path || b->watching_sleep) {
+        return process_bus_until(b->bus, deadline);
+    }
+#endif
+    while (!received_signal && !interrupted
+           && clock_nanosleep(fade_clock, TIMER_ABSTIME, deadline, NULL) == EINTR) ;
+    return 0;
+}
+
+// Process the backend until the deadline (on fade_clock) or a signal
+int backend_wait_until(struct backend *b, const struct timespec *deadline) {
+#ifdef WITH_DDC
+    // Wake up on the way whenever a busy monitor becomes ready
+    int64_t ready;
+    while (!received_signal && !interrupted && ddc_next_ready(b, &ready)
+           && ready < deadline->tv_sec * NANOSEC_PER_SEC + deadline->tv_nsec)
+    {
+        struct timespec ts = {ready / NANOSEC_PER_SEC, ready % NANOSEC_PER_SEC};
+        int status = wait_for_deadline(b, &ts);
+        if (status < 0) return status;
+        ddc_flush(b, false);
+    }
+    int status = wait_for_deadline(b, deadline);
+    ddc_flush(b, false);
+    return status;
+#else
+    return wait_for_deadline(b, deadline);
+#endif
+}
+
+// Wait until none of the devices has a call in flight or a DDC/CI write
+// held back
+int backend_wait_idle(struct backend *b, struct device *devices, int num_devices) {
+#ifdef WITH_DDC
+    ddc_flush(b, true);
+#endif
+#ifdef WITH_DBUS
+    if (b->session.path) return wait_for_replies(b->bus, devices, num_devices);
+#endif
+    return 0;
+}
+
+// The fd to poll for the backend's own events, or -1 if there is none
+void backend_pollfd(struct backend *b, struct pollfd *pfd) {
+    pfd->fd = -1;
+    pfd->events = 0;
+#ifdef WITH_DBUS
+    if (b->session.path || b->watching_sleep) {
+        pfd->fd = sd_bus_get_fd(b->bus);
+        pfd->events = sd_bus_get_events(b->bus);
+    }
+#endif
+}
+
+void backend_close(struct backend *b) {
+#ifdef WITH_DBUS
+    sd_bus_close_unref(b->bus);
+    free(b->session.path);
+#endif
+}
+
+int read_lock_owner(int fd, pid_t *pid) {
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf)-1, 0);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    *pid = strtol(buf, NULL, 10);
+    return *pid > 0 ? 0 : -1;
+}
+
+// Ask the instance holding the lock to stop without restoring its original
+// brightness, and wait for it to exit. A pidfd is used so that we can't
+// signal an unrelated process if the pid gets reused.
+int cancel_lock_owner(int fd) {
+    pid_t pid, pid_again;
+    if (read_lock_owner(fd, &pid) < 0) {
+        // The owner hasn't written its pid yet
+        return 0;
+    }
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) {
+        // Already gone
+        return errno == ESRCH ? 0 : -1;
+    }
+    // Make sure the pid still belongs to the lock holder now that it is pinned
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0
+        || read_lock_owner(fd, &pid_again) < 0 || pid_again != pid)
+    {
+        close(pidfd);
+        return 0;
+    }
+    LOG_INFO("Cancelling running instance %d\n", (int)pid);
+    if (syscall(SYS_pidfd_send_signal, pidfd, SIGUSR1, NULL, 0) < 0
+        && errno != ESRCH)
+    {
+        perror("pidfd_send_signal");
+        close(pidfd);
+        return -1;
+    }
+    // A pidfd becomes readable when the process exits
+    struct pollfd pfd = {.fd = pidfd, .events = POLLIN};
+    int ret = poll(&pfd, 1, SUPERSEDE_TIMEOUT_MILLIS);
+    close(pidfd);
+    if (ret == 0) {
+        LOG_ERROR("Instance %d did not exit\n", (int)pid);
+        return -1;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+// Take the per-device lock, cancelling any other instance which is
+// currently fading the same device. The lock is held until we exit.
+// *lock_fd is -1 if XDG_RUNTIME_DIR is unset and coordination isn't possible.
+int acquire_device_lock(const struct device *dev, int *lock_fd,
+                        bool *cancelled_other)
+{
+    char path[PATH_MAX], pid_str[32];
+    *lock_fd = -1;
+    *cancelled_other = false;
+    if (!getenv("XDG_RUNTIME_DIR")) {
+        LOG_INFO("XDG_RUNTIME_DIR not set, not coordinating with other instances\n");
+        return 0;
+    }
+    if (get_runtime_path(dev, "lock", path, sizeof(path)) < 0) return -1;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOG_ERROR("Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno != EWOULDBLOCK || cancel_lock_owner(fd) < 0) {
+            close(fd);
+            return -1;
+        }
+        if (flock(fd, LOCK_EX) < 0) {
+            perror("flock");
+            close(fd);
+            return -1;
+        }
+        *cancelled_other = true;
+    }
+    int len = snprintf(pid_str, sizeof(pid_str), "%d\n", (int)getpid());
+    if (ftruncate(fd, 0) < 0 || pwrite(fd, pid_str, len, 0) != len) {
+        LOG_ERROR("Could not write %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    *lock_fd = fd;
+    return 0;
+}
+
+int64_t boottime_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * NANOSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Read the state file of a device. Returns false if there is none.
+bool read_state(const struct device *dev, struct device_state *state) {
+    char path[PATH_MAX];
+    if (!getenv("XDG_RUNTIME_DIR")) return false;
+    if (get_runtime_path(dev, "state", path, sizeof(path)) < 0) return false;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t n = pread(fd, state, sizeof(*state), 0);
+    close(fd);
+    return n == sizeof(*state);
+}
+
+// Get the brightness which relative adjustments should be applied to:
+// the last committed target if it is still fresh, otherwise the value
+// read from sysfs.
+int get_base_brightness(const struct device *dev, int cur_brightness,
+                        int max_brightness, int *res)
+{
+    struct device_state state;
+    *res = cur_brightness;
+    if (read_state(dev, &state) && state.max_brightness == max_brightness
+        && state.expires_nanos > boottime_nanos())
+    {
+        if (state.target != cur_brightness) {
+            LOG_INFO("Using pending target %d instead of %d\n",
+                     state.target, cur_brightness);
+        }
+        *res = state.target;
+    }
+    return 0;
+}
+
+int save_target(const struct device *dev, int target, int max_brightness,
+                float countdown_sec)
+{
+    char path[PATH_MAX];
+    struct device_state state = {
+        .target = target,
+        .max_brightness = max_brightness,
+        .expires_nanos = boottime_nanos()
+            + (int64_t)(countdown_sec * NANOSEC_PER_SEC)
+            + STATE_GRACE_MILLIS * NANOSEC_PER_MILLISEC,
+    };
+    if (!getenv("XDG_RUNTIME_DIR")) return 0;
+    if (get_runtime_path(dev, "state", path, sizeof(path)) < 0) return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOG_ERROR("Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    ssize_t n = pwrite(fd, &state, sizeof(state), 0);
+    close(fd);
+    if (n != sizeof(state)) {
+        LOG_ERROR("Could not write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Hand a request over to a daemon running for this device.
+// Returns 1 if the request was delivered, 0 if no daemon is listening.
+int send_to_daemon(const struct device *dev, float countdown_sec,
+                   const char *brightness_str)
+{
+    char path[PATH_MAX], msg[PIPE_BUF];
+    if (!getenv("XDG_RUNTIME_DIR")) return 0;
+    if (get_runtime_path(dev, "fifo", path, sizeof(path)) < 0) return -1;
+    int len = snprintf(msg, sizeof(msg), "%g %s\n", countdown_sec, brightness_str);
+    if (len > (int)sizeof(msg)-1) {
+        LOG_ERROR("Brightness argument is too long\n");
+        return -1;
+    }
+    // Opening a FIFO for writing without blocking fails with ENXIO when
+    // there is no reader, i.e. no daemon
+    int fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT || errno == ENXIO) return 0;
+        LOG_ERROR("Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // Writes of at most PIPE_BUF bytes are atomic
+    ssize_t written = write(fd, msg, len);
+    close(fd);
+    if (written != len) {
+        LOG_ERROR("Could not send request to daemon: %s\n", strerror(errno));
+        return -1;
+    }
+    LOG_INFO("Sent request to daemon via %s\n", path);
+    return 1;
+}
+
+#ifdef WITH_DAEMON
+// Parse a "<countdown> <brightness>" request line and retarget the spring.
+// Relative values are applied to the pending target rather than the
+// current position, so repeated requests accumulate.
+void handle_daemon_request(char *line, struct spring *s, double now,
+                           int max_brightness)
+{
+    float countdown_sec;
+    int target_brightness;
+    char *brightness_str = strchr(line, ' ');
+    if (!brightness_str) {
+        LOG_ERROR("Malformed request: %s\n", line);
+        return;
+    }
+    *brightness_str++ = '\0';
+    if (read_countdown(line, &countdown_sec) < 0
+        || calculate_target_brightness(brightness_str, (int)s->target,
+                                       max_brightness, &target_brightness) < 0)
+    {
+        return;
+    }
+    LOG_INFO("Retargeting to %d over %gs\n", target_brightness, countdown_sec);
+    spring_retarget(s, now, target_brightness, countdown_sec);
+}
+
+int run_daemon(struct backend *b, struct device *dev, int steps_per_sec,
+               float jnd_percent, struct fade_stats *stats)
+{
+    char path[PATH_MAX], buf[4*PIPE_BUF];
+    size_t buf_len = 0;
+    struct spring spring;
+    struct timespec ts;
+    double now, next_step = 0;
+    bool moving = false;
+    int status = 0;
+
+    if (get_runtime_path(dev, "fifo", path, sizeof(path)) < 0) return -1;
+    if (mkfifo(path, 0600) < 0 && errno != EEXIST) {
+        LOG_ERROR("Could not create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int probe_fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (probe_fd >= 0) {
+        close(probe_fd);
+        LOG_ERROR("A daemon is already running for %s\n", dev->name);
+        return -1;
+    }
+    // Opening for reading and writing keeps the FIFO from reporting EOF
+    // every time a client closes it
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    LOG_INFO("Listening on %s\n", path);
+
+    clock_gettime(fade_clock, &ts);
+    spring_init(&spring, timespec_to_sec(&ts), dev->cur_brightness);
+    while (!received_signal) {
+        int timeout = -1;
+        if (moving) {
+            clock_gettime(fade_clock, &ts);
+            double wait = next_step - timespec_to_sec(&ts);
+            timeout = wait > 0 ? (int)ceil(wait * MILLISEC_PER_SEC) : 0;
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            status = -1;
+            break;
+        }
+        clock_gettime(fade_clock, &ts);
+        now = timespec_to_sec(&ts);
+
+        if (pfd.revents & POLLIN) {
+            ssize_t n = read(fd, buf + buf_len, sizeof(buf) - buf_len - 1);
+            if (n > 0) {
+                buf_len += n;
+                buf[buf_len] = '\0';
+                char *line = buf, *nl;
+                while ((nl = strchr(line, '\n'))) {
+                    *nl = '\0';
+                    handle_daemon_request(line, &spring, now, dev->max_brightness);
+                    line = nl + 1;
+                }
+                buf_len -= line - buf;
+                memmove(buf, line, buf_len);
+                if (buf_len == sizeof(buf) - 1) buf_len = 0;
+                if (!moving) {
+                    moving = true;
+                    next_step = now;
+                }
+            }
+        }
+
+        if (!moving || now < next_step) continue;
+        next_step += 1.0 / steps_per_sec;
+        if (next_step < now) next_step = now;
+
+        double pos, vel;
+        int next_brightness;
+        spring_state(&spring, now, &pos, &vel);
+        if (spring_settled(&spring, now, steps_per_sec)) {
+            next_brightness = spring.target;
+            moving = false;
+        } else {
+            next_brightness = lround(pos);
+            if (next_brightness < 0) next_brightness = 0;
+            if (next_brightness > dev->max_brightness) next_brightness = dev->max_brightness;
+            if (!is_perceptible_step(dev->cur_brightness, next_brightness, jnd_percent)) {
+                if (next_brightness != dev->cur_brightness) stats->merged++;
+                continue;
+            }
+        }
+        if (next_brightness == dev->cur_brightness) continue;
+        stats->levels += abs(next_brightness - dev->cur_brightness);
+        // Wait for each call, so that a failed one is retried on the
+        // next step
+        int prev_brightness = dev->cur_brightness;
+        if (backend_set(b, dev, next_brightness) < 0
+            || backend_wait_idle(b, dev, 1) < 0 || dev->failed)
+        {
+            dev->cur_brightness = prev_brightness;
+            dev->failed = false;
+            continue;
+        }
+        stats->calls++;
+    }
+
+    close(fd);
+    unlink(path);
+    return status < 0 ? status : 0;
+}
+#endif
+
+// Start watching actual_brightness of the devices for changes which we
+// didn't make. A device which can't be watched is faded regardless.
+void watch_external(struct device *devices, int num_devices) {
+    for (int i = 0; i < num_devices; i++) {
+        struct device *dev = &devices[i];
+        dev->actual_fd = open_attribute(dev, "actual_brightness", O_RDONLY);
+        if (dev->actual_fd < 0
+            || read_attribute(dev->actual_fd, &dev->observed_brightness) < 0)
+        {
+            LOG_INFO("Can't watch %s for external changes\n", dev->name);
+            if (dev->actual_fd >= 0) close(dev->actual_fd);
+            dev->actual_fd = -1;
+        }
+    }
+}
+
+// Read actual_brightness at a step boundary. Our own sets move it from
+// where it was at the previous boundary towards the value last sent, but
+// the hardware may round that value or approach it gradually, so only a
+// reading outside that range (give or take 1% of the maximum) counts as a
+// change made by someone else. Returns true if the policy was applied.
+bool check_external(struct device *dev, enum external_policy policy,
+                    int millis_elapsed)
+{
+    int actual;
+    if (dev->actual_fd < 0 || dev->call_pending || dev->overridden) return false;
+    if (read_attribute(dev->actual_fd, &actual) < 0) {
+        close(dev->actual_fd);
+        dev->actual_fd = -1;
+        return false;
+    }
+    int slack = dev->max_brightness / 100;
+    int low = dev->observed_brightness, high = dev->cur_brightness;
+    if (low > high) {
+        low = dev->cur_brightness;
+        high = dev->observed_brightness;
+    }
+    low -= slack;
+    high += slack;
+    dev->observed_brightness = actual;
+    if (actual >= low && actual <= high) return false;
+
+    if (policy == EXTERNAL_ABORT) {
+        LOG_INFO("%s was changed to %d by someone else, leaving it there\n",
+                 dev->name, actual);
+        dev->overridden = true;
+        // Don't let relative changes build on our target any more
+        save_target(dev, actual, dev->max_brightness, 0);
+    } else {
+        LOG_INFO("%s was changed to %d by someone else, fading on from there\n",
+                 dev->name, actual);
+        dev->fade_from = actual;
+        dev->fade_start_millis = millis_elapsed;
+    }
+    // Either way, this is what an interrupted fade goes back to
+    dev->orig_brightness = actual;
+    dev->cur_brightness = actual;
+    return true;
+}
+
+void record_step_lateness(struct fade_stats *stats, int64_t nanos) {
+    if (!stats->lateness) return;
+    stats->lateness[stats->num_steps++ % STEP_LATENESS_SAMPLES]
+        = nanos / 1000;
+}
+
+int compare_int32(const void *a, const void *b) {
+    int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Print the median, 99th percentile and maximum of the step lateness. This
+// sorts the samples.
+void print_step_lateness(struct fade_stats *stats) {
+    int n = stats->num_steps < STEP_LATENESS_SAMPLES
+        ? stats->num_steps : STEP_LATENESS_SAMPLES;
+    if (!stats->lateness) return;
+    if (n == 0) {
+        fprintf(stderr, "No fade steps were taken\n");
+        return;
+    }
+    qsort(stats->lateness, n, sizeof(*stats->lateness), compare_int32);
+    fprintf(stderr, "Fade steps were late by %d us (median), %d us (99th "
+            "percentile), %d us (max) over %d steps\n",
+            stats->lateness[(n-1) / 2], stats->lateness[(int64_t)(n-1) * 99 / 100],
+            stats->lateness[n-1], n);
+}
+
+// Fade all devices towards their targets in lockstep. Every device gets at
+// most one call in flight; a device whose previous call hasn't returned yet
+// skips steps instead of holding up the others.
+int run_fade(struct backend *b, struct device *devices, int num_devices,
+             float countdown_sec, int steps_per_sec, float jnd_percent,
+             enum external_policy on_external, struct fade_stats *stats)
+{
+    long step_nanos = NANOSEC_PER_SEC / steps_per_sec;
+    int total_millis = countdown_sec * MILLISEC_PER_SEC;
+    struct timespec start_time,
+                    current_time,
+                    next_step_time,
+                    target_time;
+    int status = 0;
+
+    clock_gettime(fade_clock, &start_time);
+    add_nanoseconds_to_timespec(&start_time, (long)(countdown_sec * NANOSEC_PER_SEC), &target_time);
+    memcpy(&next_step_time, &start_time, sizeof(next_step_time));
+    for (int i = 0; i < num_devices; i++) {
+        stats->levels += abs(devices[i].target_brightness - devices[i].orig_brightness);
+        devices[i].fade_from = devices[i].orig_brightness;
+        devices[i].fade_start_millis = 0;
+    }
+    if (on_external != EXTERNAL_IGNORE) {
+        watch_external(devices, num_devices);
+    }
+
+    // Steps are scheduled on absolute deadlines so that the time spent in
+    // method calls doesn't accumulate as drift
+    while (!received_signal && !interrupted) {
+        add_nanoseconds_to_timespec(&next_step_time, step_nanos, &next_step_time);
+        if (timespec_cmp(&next_step_time, &target_time) >= 0) break;
+        status = backend_wait_until(b, &next_step_time);
+        if (status < 0 || received_signal || interrupted) break;
+        bool held = false;
+#ifdef WITH_DBUS
+        if (going_to_sleep) {
+            if (on_sleep == SLEEP_COMPLETE) {
+                LOG_INFO("Going to sleep, completing the fade\n");
+                break;
+            }
+            status = hold_fade_for_sleep(b, &start_time, &target_time);
+            if (status < 0 || received_signal || interrupted) break;
+            held = true;
+        }
+#endif
+        clock_gettime(fade_clock, &current_time);
+        if (!held) {
+            record_step_lateness(stats,
+                (current_time.tv_sec - next_step_time.tv_sec) * NANOSEC_PER_SEC
+                + current_time.tv_nsec - next_step_time.tv_nsec);
+        }
+        // If we fell behind, don't try to catch up with a burst of steps
+        if (timespec_diff_in_millis(&current_time, &next_step_time)
+                > step_nanos / NANOSEC_PER_MILLISEC)
+        {
+            memcpy(&next_step_time, &current_time, sizeof(next_step_time));
+        }
+        int millis_elapsed = timespec_diff_in_millis(&current_time, &start_time);
+        if (millis_elapsed >= total_millis) break;
+        for (int i = 0; i < num_devices; i++) {
+            struct device *dev = &devices[i];
+            check_external(dev, on_external, millis_elapsed);
+            if (dev->failed || dev->call_pending || dev->overridden) continue;
+            int next_brightness = dev->fade_from + (int)(
+                ((int64_t)(millis_elapsed - dev->fade_start_millis)
+                 * (dev->target_brightness - dev->fade_from))
+                / (total_millis - dev->fade_start_millis));
+            if (next_brightness == dev->cur_brightness) continue;
+            if (!is_perceptible_step(dev->cur_brightness, next_brightness, jnd_percent)) {
+                stats->merged++;
+                continue;
+            }
+            if (backend_set(b, dev, next_brightness) == 0) {
+                stats->calls++;
+            }
+        }
+    }
+    if (backend_wait_idle(b, devices, num_devices) < 0) status = -1;
+
+    if (superseded) {
+        LOG_INFO("Superseded by another instance, stopping\n");
+    } else {
+        bool restore = received_signal || interrupted;
+        if (received_signal) {
+            LOG_INFO("Received signal, restoring original brightness\n");
+        } else if (interrupted) {
+            LOG_INFO("Interrupted, restoring original brightness\n");
+        }
+        for (int i = 0; i < num_devices; i++) {
+            struct device *dev = &devices[i];
+            check_external(dev, on_external, total_millis);
+            if (dev->overridden) continue;
+            // We might need one more step
+            int final_brightness = restore
+                ? dev->orig_brightness : dev->target_brightness;
+            if (restore) {
+                save_target(dev, final_brightness, dev->max_brightness, 0);
+            }
+            if (dev->failed || dev->cur_brightness == final_brightness) continue;
+            if (backend_set(b, dev, final_brightness) == 0) {
+                stats->calls++;
+            }
+        }
+        if (backend_wait_idle(b, devices, num_devices) < 0) status = -1;
+    }
+
+    for (int i = 0; i < num_devices; i++) {
+        if (devices[i].failed) status = -1;
+        if (devices[i].actual_fd >= 0) {
+            close(devices[i].actual_fd);
+            devices[i].actual_fd = -1;
+        }
+    }
+    return status < 0 ? -1 : 0;
+}
+
+#ifdef WITH_MIRROR
+// Map the leader's level onto a follower, going through the fraction of
+// the maximum so that devices with different ranges stay in step
+int mirror_brightness(const struct device *leader, int leader_brightness,
+                      const struct device *follower, float curve)
+{
+    double fraction = (double)leader_brightness / leader->max_brightness;
+    if (fraction < 0) fraction = 0;
+    if (fraction > 1) fraction = 1;
+    return lround(pow(fraction, curve) * follower->max_brightness);
+}
+
+// Listen for devices being added and removed. Normally this is the kernel's
+// uevent netlink socket; source may instead name a FIFO which supplies
+// events as text lines of the form "<action> <subsystem> <name>".
+int open_uevent_monitor(const char *source) {
+    if (source) {
+        // Keep a writer open ourselves so the FIFO never reports EOF
+        int fd = open(source, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            LOG_ERROR("Could not open %s: %s\n", source, strerror(errno));
+        }
+        return fd;
+    }
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = 1,  // kernel events
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Parse a kernel uevent: "<action>@<devpath>" followed by KEY=VALUE
+// fields, all NUL separated
+bool parse_kernel_uevent(char *buf, size_t len, struct uevent *ev) {
+    const char *devpath = NULL;
+    memset(ev, 0, sizeof(*ev));
+    for (size_t i = strlen(buf) + 1; i < len; i += strlen(buf+i) + 1) {
+        if (strncmp(buf+i, "ACTION=", 7) == 0) ev->action = buf+i+7;
+        else if (strncmp(buf+i, "SUBSYSTEM=", 10) == 0) ev->subsystem = buf+i+10;
+        else if (strncmp(buf+i, "DEVPATH=", 8) == 0) devpath = buf+i+8;
+    }
+    if (!ev->action || !ev->subsystem || !devpath) return false;
+    const char *slash = strrchr(devpath, '/');
+    ev->name = slash ? slash+1 : devpath;
+    return true;
+}
+
+bool parse_text_uevent(char *line, struct uevent *ev) {
+    char *saveptr;
+    ev->action = strtok_r(line, " \t", &saveptr);
+    ev->subsystem = strtok_r(NULL, " \t", &saveptr);
+    ev->name = strtok_r(NULL, " \t", &saveptr);
+    return ev->name != NULL;
+}
+
+// Apply a hotplug event to the mirror's followers. Devices which disappear
+// are only marked as removed, so that they keep their place in the index
+// and come back if they are plugged in again.
+int handle_mirror_uevent(struct backend *b, const struct uevent *ev,
+                         struct device **devices, int *num_devices,
+                         bool all_devices, bool *dirty)
+{
+    if (strcmp(ev->subsystem, "backlight") != 0) return 0;
+    struct device *dev = find_device(*devices, "backlight", ev->name);
+    if (strcmp(ev->action, "remove") == 0) {
+        if (!dev) return 0;
+        if (dev == &(*devices)[0]) {
+            LOG_ERROR("Device %s was removed\n", ev->name);
+            return -1;
+        }
+        LOG_INFO("Device %s was removed\n", ev->name);
+        dev->removed = true;
+        return 0;
+    }
+    if (strcmp(ev->action, "add") != 0) return 0;
+    if (!dev) {
+        if (!all_devices) return 0;
+        // Growing the list may move it, so let calls into it finish first
+        if (backend_wait_idle(b, *devices, *num_devices) < 0) return -1;
+        dev = add_device(devices, num_devices, "backlight", ev->name);
+        if (!dev) return -1;
+    }
+    LOG_INFO("Device %s was added\n", ev->name);
+    if (read_brightness(dev, &dev->cur_brightness, &dev->max_brightness) < 0) {
+        dev->removed = true;
+        return 0;
+    }
+    dev->removed = false;
+    dev->failed = backend_open(b, dev, 1) < 0;
+    *dirty = true;
+    return 0;
+}
+
+int read_uevents(struct backend *b, int fd, bool text_source,
+                 struct device **devices, int *num_devices, bool all_devices,
+                 bool *dirty)
+{
+    static char buf[UEVENT_BUFFER_SIZE];
+    static size_t buf_len = 0;
+    struct uevent ev;
+    ssize_t n;
+    while ((n = read(fd, buf + buf_len, sizeof(buf) - buf_len - 1)) > 0) {
+        if (!text_source) {
+            buf[n] = '\0';
+            if (parse_kernel_uevent(buf, n, &ev)
+                && handle_mirror_uevent(b, &ev, devices, num_devices,
+                                        all_devices, dirty) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        buf_len += n;
+        buf[buf_len] = '\0';
+        char *line = buf, *nl;
+        while ((nl = strchr(line, '\n'))) {
+            *nl = '\0';
+            if (parse_text_uevent(line, &ev)
+                && handle_mirror_uevent(b, &ev, devices, num_devices,
+                                        all_devices, dirty) < 0)
+            {
+                return -1;
+            }
+            line = nl + 1;
+        }
+        buf_len -= line - buf;
+        memmove(buf, line, buf_len);
+        if (buf_len == sizeof(buf) - 1) buf_len = 0;
+    }
+    if (n < 0 && errno != EAGAIN) {
+        perror("read");
+        return -1;
+    }
+    return 0;
+}
+
+// Copy the brightness of the first device onto all the others whenever it
+// changes. The kernel notifies pollers of actual_brightness on every
+// change, whether it came from a hotkey handled by the firmware or from a
+// write to brightness, so there is no need to poll on a timer. Updates
+// are coalesced to at most one per frame. Followers are added and removed
+// as they are hotplugged.
+int run_mirror(struct backend *b, struct device **devices, int *num_devices,
+               bool all_devices, const char *uevent_source, int steps_per_sec,
+               float curve, struct fade_stats *stats)
+{
+    int64_t frame_nanos = NANOSEC_PER_SEC / steps_per_sec;
+    int64_t next_flush = 0;
+    int leader_brightness;
+    bool dirty = true;
+    int status = 0;
+
+    int fd = open_attribute(&(*devices)[0], "actual_brightness", O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR("Could not open actual_brightness of %s: %s\n",
+                  (*devices)[0].name, strerror(errno));
+        return -1;
+    }
+    // Reading the attribute arms the notification
+    if (read_attribute(fd, &leader_brightness) < 0) {
+        close(fd);
+        return -1;
+    }
+    int uevent_fd = open_uevent_monitor(uevent_source);
+    if (uevent_fd < 0) {
+        close(fd);
+        return -1;
+    }
+
+    while (!received_signal) {
+        int64_t now = boottime_nanos();
+        if (dirty && now >= next_flush) {
+            struct device *leader = &(*devices)[0];
+            dirty = false;
+            for (int i = 1; i < *num_devices; i++) {
+                struct device *dev = &(*devices)[i];
+                if (dev->removed || dev->failed) continue;
+                // A follower which is still busy gets the latest value on
+                // the next frame instead
+                if (dev->call_pending) {
+                    dirty = true;
+                    continue;
+                }
+                int target = mirror_brightness(leader, leader_brightness, dev, curve);
+                if (target == dev->cur_brightness) continue;
+                LOG_INFO("Mirroring %d onto %s as %d\n", leader_brightness, dev->name, target);
+                stats->levels += abs(target - dev->cur_brightness);
+                if (backend_set(b, dev, target) == 0) {
+                    stats->calls++;
+                }
+            }
+            next_flush = now + frame_nanos;
+        }
+
+        int timeout = -1;
+        if (dirty) {
+            timeout = (next_flush - now + NANOSEC_PER_MILLISEC - 1) / NANOSEC_PER_MILLISEC;
+            if (timeout < 0) timeout = 0;
+        }
+        struct pollfd pfds[3] = {
+            {.fd = fd, .events = POLLPRI | POLLERR},
+            {0},
+            {.fd = uevent_fd, .events = POLLIN},
+        };
+        backend_pollfd(b, &pfds[1]);
+        if (poll(pfds, 3, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            status = -1;
+            break;
+        }
+        if (pfds[0].revents & (POLLPRI | POLLERR)) {
+            if (read_attribute(fd, &leader_brightness) < 0) {
+                status = -1;
+                break;
+            }
+            dirty = true;
+        }
+        if (backend_process(b) < 0) {
+            status = -1;
+            break;
+        }
+        if ((pfds[2].revents & POLLIN)
+            && read_uevents(b, uevent_fd, uevent_source != NULL, devices,
+                            num_devices, all_devices, &dirty) < 0)
+        {
+            status = -1;
+            break;
+        }
+    }
+
+    close(fd);
+    close(uevent_fd);
+    if (backend_wait_idle(b, *devices, *num_devices) < 0) status = -1;
+    return status;
+}
+#endif
+
+int read_query_format(const char *s, enum query_format *res) {
+    if (strcmp(s, "tsv") == 0) {
+        *res = QUERY_TSV;
+    } else if (strcmp(s, "json") == 0) {
+        *res = QUERY_JSON;
+    } else if (strcmp(s, "percent") == 0) {
+        *res = QUERY_PERCENT;
+    } else {
+        LOG_ERROR("Invalid format (must be json, tsv or percent)\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Read an attribute in dir relative to dfd, without the trailing newline.
+// Returns its length, or -1.
+int read_attribute_at(int dfd, const char *dir, const char *attribute,
+                      char *buf, size_t size)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, attribute);
+    int fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, buf, size-1, 0);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    n = strcspn(buf, "\n");
+    buf[n] = '\0';
+    return n;
+}
+
+int read_int_attribute_at(int dfd, const char *dir,
+                          const char *attribute, int *res)
+{
+    char buf[32], *endptr;
+    if (read_attribute_at(dfd, dir, attribute, buf, sizeof(buf)) <= 0) {
+        return -1;
+    }
+    long l = strtol(buf, &endptr, 10);
+    if (*endptr != '\0') return -1;
+    *res = l;
+    return 0;
+}
+
+void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            printf("\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            printf("\\u%04x", *s);
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+// Read everything --query reports about a device. LEDs and monitors have
+// neither actual_brightness nor a type, so their class is reported as the
+// type instead.
+int read_query_result(int dfd, struct device *dev, struct query_result *res) {
+    char dir[NAME_MAX+32];
+#ifdef WITH_DDC
+    if (is_ddc(dev)) {
+        res->have_actual = false;
+        strcpy(res->type, "ddc");
+        return ddc_read_brightness(dev, &res->brightness, &res->max_brightness);
+    }
+#endif
+    snprintf(dir, sizeof(dir), "%s/%s", dev->subsystem, dev->name);
+    if (read_int_attribute_at(dfd, dir, "brightness", &res->brightness) < 0
+        || read_int_attribute_at(dfd, dir, "max_brightness",
+                                 &res->max_brightness) < 0
+        || res->max_brightness <= 0)
+    {
+        return -1;
+    }
+    // Some drivers fail to report actual_brightness, e.g. while the panel
+    // is off
+    res->have_actual = read_int_attribute_at(
+        dfd, dir, "actual_brightness", &res->actual_brightness) == 0;
+    if (strcmp(dev->subsystem, "backlight") != 0) {
+        snprintf(res->type, sizeof(res->type), "%s", dev->subsystem);
+    } else if (read_attribute_at(dfd, dir, "type", res->type, sizeof(res->type)) <= 0) {
+        strcpy(res->type, "unknown");
+    }
+    return 0;
+}
+
+// Print one device's entry. JSON objects are printed without a separator
+// or newline, so that the caller can put them into an array or on lines.
+void print_query_result(const char *device_name, const struct query_result *r,
+                        enum query_format format, bool with_name)
+{
+    switch (format) {
+    case QUERY_TSV:
+        printf("%s\t%d\t", device_name, r->brightness);
+        if (r->have_actual) {
+            printf("%d", r->actual_brightness);
+        } else {
+            putchar('-');
+        }
+        printf("\t%d\t%s\n", r->max_brightness, r->type);
+        break;
+    case QUERY_JSON:
+        printf("{\"name\":");
+        print_json_string(device_name);
+        printf(",\"type\":");
+        print_json_string(r->type);
+        printf(",\"brightness\":%d,\"actual_brightness\":", r->brightness);
+        if (r->have_actual) {
+            printf("%d", r->actual_brightness);
+        } else {
+            printf("null");
+        }
+        printf(",\"max_brightness\":%d}", r->max_brightness);
+        break;
+    case QUERY_PERCENT:
+        if (with_name) {
+            printf("%s ", device_name);
+        }
+        printf("%ld\n", lround(100.0 * (r->have_actual ? r->actual_brightness
+                                                       : r->brightness)
+                               / r->max_brightness));
+        break;
+    }
+}
+
+int open_class_dir(void) {
+    static const char *dir = "/sys/class";
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        LOG_ERROR("Error opening directory %s\n", dir);
+    }
+    return dfd;
+}
+
+// Print the state of each device for --query. This never goes near the
+// bus: every attribute is read with one openat() and pread() relative to
+// /sys/class.
+int run_query(struct device *devices, int num_devices,
+              enum query_format format)
+{
+    struct query_result result;
+    int status = 0;
+    bool first = true;
+    int dfd = open_class_dir();
+    if (dfd < 0) return -1;
+    if (format == QUERY_JSON) putchar('[');
+    for (int i = 0; i < num_devices; i++) {
+        if (read_query_result(dfd, &devices[i], &result) < 0) {
+            LOG_ERROR("Could not read brightness of %s\n", devices[i].name);
+            status = -1;
+            continue;
+        }
+        if (format == QUERY_JSON && !first) putchar(',');
+        print_query_result(devices[i].name, &result, format, num_devices > 1);
+        first = false;
+    }
+    if (format == QUERY_JSON) printf("]\n");
+    close(dfd);
+    return status;
+}
+
+// Note when another instance announces a fade of one of our devices in its
+// state file. Returns the latest time such a fade may still be running.
+int64_t read_follow_inotify(int fd, const struct device *devices,
+                            int num_devices, int64_t active_until)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            for (int i = 0; ev->len && i < num_devices; i++) {
+                char name[NAME_MAX+32];
+                struct device_state state;
+                if (get_runtime_name(&devices[i], "state", name, sizeof(name)) < 0
+                    || strcmp(ev->name, name) != 0)
+                {
+                    continue;
+                }
+                if (read_state(&devices[i], &state)
+                    && state.expires_nanos > active_until)
+                {
+                    active_until = state.expires_nanos;
+                }
+            }
+        }
+    }
+    return active_until;
+}
+
+// Print the state of each device, and then again whenever it changes.
+// Changes are noticed through sysfs notifications: brightness_hw_changed
+// where the driver has it reports changes made by the hardware, and
+// actual_brightness is notified by the backlight core on writes. Drivers
+// which notify neither are caught by polling, which runs at the frame rate
+// while another instance has announced a fade in its state file, and
+// otherwise backs off to FOLLOW_POLL_MAX_MILLIS while nothing changes.
+// Polling stops once every device has been seen to notify.
+int run_follow(struct device *devices, int num_devices, enum query_format format,
+               int steps_per_sec)
+{
+    static const char *notify_attributes[] = {"brightness_hw_changed",
+                                              "actual_brightness"};
+    int frame_millis = (MILLISEC_PER_SEC + steps_per_sec - 1) / steps_per_sec;
+    int poll_millis = frame_millis;
+    int64_t active_until = 0;
+    int status = 0;
+    struct query_result *last = calloc(num_devices, sizeof(*last));
+    bool *notifies = calloc(num_devices, sizeof(*notifies));
+    // Two attributes per device, then the inotify fd
+    struct pollfd *pfds = calloc(2*num_devices + 1, sizeof(*pfds));
+    int dfd = open_class_dir();
+    if (!last || !notifies || !pfds || dfd < 0) {
+        if (dfd >= 0) close(dfd);
+        free(last);
+        free(notifies);
+        free(pfds);
+        return -1;
+    }
+
+    for (int i = 0; i < num_devices; i++) {
+        for (int j = 0; j < 2; j++) {
+            char path[PATH_MAX], buf[32];
+            struct pollfd *pfd = &pfds[2*i + j];
+            snprintf(path, sizeof(path), "%s/%s/%s", devices[i].subsystem,
+                     devices[i].name, notify_attributes[j]);
+            pfd->fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+            pfd->events = POLLPRI | POLLERR;
+            // Reading the attribute arms the notification
+            if (pfd->fd >= 0) pread(pfd->fd, buf, sizeof(buf), 0);
+        }
+    }
+    struct pollfd *inotify_pfd = &pfds[2*num_devices];
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    inotify_pfd->fd = -1;
+    inotify_pfd->events = POLLIN;
+    if (runtime_dir) {
+        inotify_pfd->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_pfd->fd >= 0
+            && inotify_add_watch(inotify_pfd->fd, runtime_dir,
+                                 IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        {
+            close(inotify_pfd->fd);
+            inotify_pfd->fd = -1;
+        }
+    }
+
+    bool first = true;
+    while (!received_signal) {
+        bool changed = false;
+        for (int i = 0; i < num_devices; i++) {
+            struct query_result result;
+            if (read_query_result(dfd, &devices[i], &result) < 0) continue;
+            if (!first && result.brightness == last[i].brightness
+                && result.have_actual == last[i].have_actual
+                && (!result.have_actual
+                    || result.actual_brightness == last[i].actual_brightness)
+                && result.max_brightness == last[i].max_brightness)
+            {
+                continue;
+            }
+            print_query_result(devices[i].name, &result, format, num_devices > 1);
+            if (format == QUERY_JSON) putchar('\n');
+            last[i] = result;
+            changed = true;
+        }
+        if (changed) {
+            fflush(stdout);
+        }
+        first = false;
+
+        bool all_notify = true;
+        for (int i = 0; i < num_devices; i++) {
+            all_notify &= notifies[i];
+        }
+        int timeout;
+        int64_t now = boottime_nanos();
+        if (all_notify) {
+            timeout = -1;
+        } else if (now < active_until) {
+            timeout = frame_millis;
+            poll_millis = frame_millis;
+        } else {
+            // Back off while polling finds nothing
+            poll_millis = changed ? frame_millis : poll_millis * 2;
+            if (poll_millis > FOLLOW_POLL_MAX_MILLIS) poll_millis = FOLLOW_POLL_MAX_MILLIS;
+            timeout = poll_millis;
+        }
+        if (poll(pfds, 2*num_devices + 1, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            status = -1;
+            break;
+        }
+        for (int i = 0; i < 2*num_devices; i++) {
+            char buf[32];
+            if (!(pfds[i].revents & (POLLPRI | POLLERR))) continue;
+            pread(pfds[i].fd, buf, sizeof(buf), 0);
+            notifies[i/2] = true;
+        }
+        if (inotify_pfd->revents & POLLIN) {
+            active_until = read_follow_inotify(inotify_pfd->fd, devices,
+                                               num_devices, active_until);
+        }
+    }
+
+    for (int i = 0; i < 2*num_devices + 1; i++) {
+        if (pfds[i].fd >= 0) close(pfds[i].fd);
+    }
+    close(dfd);
+    free(last);
+    free(notifies);
+    free(pfds);
+    return status;
+}
+
+// Prepare a device for a fade. Returns 1 if a daemon took the request over.
+int claim_device(struct device *dev, const char *brightness_str,
+                 float countdown_sec)
+{
+    int base_brightness, target, status;
+    bool cancelled_other;
+
+    // If a daemon owns this device, let it blend the new target into
+    // whatever fade it is running
+    status = send_to_daemon(dev, countdown_sec, brightness_str);
+    if (status != 0) {
+        return status;
+    }
+
+    // Apply relative adjustments to the target of the previous request, so
+    // that a burst of key presses adds up even if sysfs hasn't caught up.
+    // Check the value before stopping anyone, so that a request which is out
+    // of range leaves the other fade alone.
+    status = get_base_brightness(
+        dev, dev->cur_brightness, dev->max_brightness, &base_brightness);
+    if (status < 0) {
+        return status;
+    }
+    status = calculate_target_brightness(
+        brightness_str, base_brightness, dev->max_brightness, &target);
+    if (status < 0) {
+        return status;
+    }
+
+    // Stop any other instance which is still fading this device. It left
+    // the brightness somewhere along its fade, so start from there.
+    status = acquire_device_lock(dev, &dev->lock_fd, &cancelled_other);
+    if (status < 0) {
+        return status;
+    }
+    if (cancelled_other) {
+        status = read_brightness(dev, &dev->cur_brightness, &dev->max_brightness);
+        if (status < 0) {
+            return status;
+        }
+        dev->orig_brightness = dev->cur_brightness;
+        status = get_base_brightness(
+            dev, dev->cur_brightness, dev->max_brightness, &base_brightness);
+        if (status < 0) {
+            return status;
+        }
+        status = calculate_target_brightness(
+            brightness_str, base_brightness, dev->max_brightness, &target);
+        if (status < 0) {
+            // The other fade stopped short of the target in the state file,
+            // so record where the panel was actually left
+            save_target(dev, dev->cur_brightness, dev->max_brightness, 0);
+            return status;
+        }
+    }
+    if (base_brightness != dev->cur_brightness || cancelled_other) {
+        dev->target_brightness = target;
+        LOG_INFO("New brightness for %s will be %u\n", dev->name, dev->target_brightness);
+    }
+    return save_target(dev, dev->target_brightness, dev->max_brightness,
+                       countdown_sec);
+}
+
+// A command read by --stdin:
+//   get [DEVICE]
+//   set BRIGHTNESS [DEVICE]
+//   fade COUNTDOWN BRIGHTNESS [DEVICE]
+//   sleep SECONDS
+struct command {
+    enum {
+        COMMAND_NONE,   // blank line
+        COMMAND_GET,
+        COMMAND_SET,
+        COMMAND_FADE,
+        COMMAND_SLEEP,
+    } type;
+    float seconds;
+    const char *value;
+    const char *device;     // NULL for all devices
+    char line[COMMAND_BUFFER_SIZE+1];
+};
+
+// Splits newline-delimited commands out of a file descriptor. The current
+// line stays at the start of buf until it is consumed.
+struct command_reader {
+    int fd;
+    char buf[COMMAND_BUFFER_SIZE];
+    size_t len;
+    size_t line_len;        // including the newline, 0 if incomplete
+    bool eof;
+};
+
+// Make sure a complete line is buffered. Without wait, only input which is
+// already available is read. Returns 1 if there is a line, 0 if not (yet,
+// or at the end of input, or after a signal), -1 on error.
+int fill_command(struct command_reader *r, bool wait) {
+    while (!r->line_len) {
+        char *nl = memchr(r->buf, '\n', r->len);
+        if (nl) {
+            r->line_len = nl - r->buf + 1;
+            break;
+        }
+        if (r->eof) {
+            // Accept a last line without a newline
+            r->line_len = r->len;
+            return r->len > 0;
+        }
+        if (r->len == sizeof(r->buf)) {
+            LOG_ERROR("Command is too long\n");
+            return -1;
+        }
+        if (!wait) {
+            struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+            if (poll(&pfd, 1, 0) <= 0) return 0;
+        }
+        ssize_t n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("read");
+                return -1;
+            }
+            if (received_signal) return 0;
+            continue;
+        }
+        if (n == 0) r->eof = true;
+        r->len += n;
+    }
+    return 1;
+}
+
+// Parse the current line of r into cmd and consume it
+int take_command(struct command_reader *r, struct command *cmd) {
+    char *words[4], *word, *save;
+    int num_words = 0;
+
+    memset(cmd, 0, sizeof(*cmd));
+    memcpy(cmd->line, r->buf, r->line_len);
+    cmd->line[r->line_len] = '\0';
+    memmove(r->buf, r->buf + r->line_len, r->len - r->line_len);
+    r->len -= r->line_len;
+    r->line_len = 0;
+
+    for (word = strtok_r(cmd->line, " \t\r\n", &save); word;
+         word = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if (num_words == 4) goto invalid;
+        words[num_words++] = word;
+    }
+    if (num_words == 0) return 0;
+    if (strcmp(words[0], "get") == 0 && num_words <= 2) {
+        cmd->type = COMMAND_GET;
+        cmd->device = num_words == 2 ? words[1] : NULL;
+    } else if (strcmp(words[0], "set") == 0 && num_words >= 2 && num_words <= 3) {
+        cmd->type = COMMAND_SET;
+        cmd->value = words[1];
+        cmd->device = num_words == 3 ? words[2] : NULL;
+    } else if (strcmp(words[0], "fade") == 0 && num_words >= 3) {
+        cmd->type = COMMAND_FADE;
+        if (read_countdown(words[1], &cmd->seconds) < 0) return -1;
+        cmd->value = words[2];
+        cmd->device = num_words == 4 ? words[3] : NULL;
+    } else if (strcmp(words[0], "sleep") == 0 && num_words == 2) {
+        cmd->type = COMMAND_SLEEP;
+        if (read_countdown(words[1], &cmd->seconds) < 0) return -1;
+    } else {
+        goto invalid;
+    }
+    return 0;
+invalid:
+    LOG_ERROR("Invalid command\n");
+    return -1;
+}
+
+void print_command_result(int status) {
+    printf(status < 0 ? "error\n" : "ok\n");
+}
+
+// The devices a command applies to: all of them, or the one it names
+int get_command_devices(struct device *devices, int num_devices,
+                        const struct command *cmd,
+                        struct device **group, int *group_size)
+{
+    if (!cmd->device) {
+        *group = devices;
+        *group_size = num_devices;
+        return 0;
+    }
+    const char *subsystem, *name;
+    if (parse_device_name(cmd->device, &subsystem, &name) < 0) return -1;
+    *group = find_device(devices, subsystem, name);
+    if (!*group) {
+        LOG_ERROR("Device %s wasn't selected\n", cmd->device);
+        return -1;
+    }
+    *group_size = 1;
+    return 0;
+}
+
+// Claim a device for a change from its current brightness to target, as
+// an invocation with value would
+int claim_target(struct device *dev, const char *value, float countdown_sec,
+                 int target)
+{
+    dev->orig_brightness = dev->cur_brightness;
+    dev->target_brightness = target;
+    dev->failed = false;
+    dev->overridden = false;
+    // Our own lock from a pending set would get in the way
+    if (dev->lock_fd >= 0) close(dev->lock_fd);
+    dev->lock_fd = -1;
+    int status = claim_device(dev, value, countdown_sec);
+    if (status < 0) return -1;
+    if (status == 1) {
+        // A daemon took it over
+        dev->target_brightness = dev->cur_brightness;
+    }
+    return 0;
+}
+
+// Work out the new targets of a set or fade and claim the devices, as a
+// single invocation would. With pending, the targets of previous sets
+// which haven't been applied yet are the base of relative values. Nothing
+// is changed unless the value is valid for every device.
+int prepare_command(struct device *group, int group_size,
+                    const struct command *cmd, bool pending, int *targets)
+{
+    for (int i = 0; i < group_size; i++) {
+        struct device *dev = &group[i];
+        if (!pending && read_brightness(dev, &dev->cur_brightness,
+                                        &dev->max_brightness) < 0)
+        {
+            return -1;
+        }
+        int base = pending ? dev->target_brightness : dev->cur_brightness;
+        if (calculate_target_brightness(cmd->value, base, dev->max_brightness,
+                                        &targets[i]) < 0)
+        {
+            return -1;
+        }
+    }
+    for (int i = 0; i < group_size; i++) {
+        if (claim_target(&group[i], cmd->value, cmd->seconds, targets[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Fade the devices to their targets and release them, then report the
+// result of the commands which led there
+int apply_command(struct backend *b, struct device *group, int group_size,
+                  float countdown_sec, int steps_per_sec, float jnd_percent,
+                  enum external_policy on_external, struct fade_stats *stats,
+                  int num_results)
+{
+    int status = 0;
+    bool have_changes = false;
+    for (int i = 0; i < group_size; i++) {
+        have_changes |= group[i].target_brightness != group[i].cur_brightness;
+    }
+    if (have_changes) {
+        status = run_fade(b, group, group_size, countdown_sec, steps_per_sec,
+                          jnd_percent, on_external, stats);
+        // An interrupted fade didn't reach the target
+        if (received_signal || interrupted) status = -1;
+    }
+    for (int i = 0; i < group_size; i++) {
+        if (group[i].lock_fd >= 0) close(group[i].lock_fd);
+        group[i].lock_fd = -1;
+    }
+    while (num_results-- > 0) {
+        print_command_result(status);
+    }
+    return status;
+}
+
+// Set a device whose current brightness was just read to an absolute
+// value at once, claiming it like an invocation would
+int set_device(struct backend *b, struct device *dev, int brightness,
+               struct fade_stats *stats)
+{
+    char value[16];
+    snprintf(value, sizeof(value), "%d", brightness);
+    if (claim_target(dev, value, 0, brightness) < 0) return -1;
+    return apply_command(b, dev, 1, 0, DEFAULT_STEPS_PER_SEC, 0, EXTERNAL_IGNORE,
+                         stats, 0);
+}
+
+// Execute commands from standard input in order, writing one result line
+// for each, over the bus connection and device handles opened at startup.
+// With batch, a set which is directly followed by another set of the same
+// devices is only applied together with it, if the second is already
+// available. Returns -1 if any command failed.
+int run_stdin(struct backend *b, struct device *devices, int num_devices,
+              bool batch, int steps_per_sec, float jnd_percent,
+              enum external_policy on_external, struct fade_stats *stats)
+{
+    struct command_reader *reader = calloc(1, sizeof(*reader));
+    struct command *cmd = malloc(sizeof(*cmd));
+    int *targets = malloc(num_devices * sizeof(*targets));
+    struct device *group = NULL, *pending_group = NULL;
+    int group_size = 0, pending_group_size = 0;
+    int num_pending = 0;    // sets waiting to be applied
+    int status = 0, ret;
+
+    if (!reader || !cmd || !targets) {
+        perror("malloc");
+        status = -1;
+        goto finish;
+    }
+    reader->fd = STDIN_FILENO;
+    while (!received_signal) {
+        // Apply pending sets before waiting for more input
+        if (num_pending > 0 && (ret = fill_command(reader, false)) <= 0) {
+            if (ret < 0) break;
+            if (apply_command(b, pending_group, pending_group_size, 0,
+                              steps_per_sec, jnd_percent, on_external,
+                              stats, num_pending) < 0)
+            {
+                status = -1;
+            }
+            num_pending = 0;
+            fflush(stdout);
+            continue;
+        }
+        if ((ret = fill_command(reader, true)) <= 0) {
+            if (ret < 0) status = -1;
+            break;
+        }
+        ret = take_command(reader, cmd);
+        if (ret == 0 && cmd->type == COMMAND_NONE) continue;
+        if (ret == 0 && cmd->type != COMMAND_SLEEP) {
+            ret = get_command_devices(devices, num_devices, cmd, &group, &group_size);
+        }
+        bool joins_pending = ret == 0 && num_pending > 0
+            && cmd->type == COMMAND_SET
+            && group == pending_group && group_size == pending_group_size;
+        if (joins_pending) {
+            ret = prepare_command(group, group_size, cmd, true, targets);
+            if (ret == 0) {
+                num_pending++;
+                continue;
+            }
+        }
+        if (num_pending > 0) {
+            if (apply_command(b, pending_group, pending_group_size, 0,
+                              steps_per_sec, jnd_percent, on_external,
+                              stats, num_pending) < 0)
+            {
+                status = -1;
+            }
+            num_pending = 0;
+        }
+        if (ret < 0 || received_signal) goto done;
+
+        switch (cmd->type) {
+            case COMMAND_GET:
+                for (int i = 0; i < group_size; i++) {
+                    struct device *dev = &group[i];
+                    ret = read_brightness(dev, &dev->cur_brightness,
+                                          &dev->max_brightness);
+                    if (ret < 0) break;
+                }
+                if (ret < 0) break;
+                for (int i = 0; i < group_size; i++) {
+                    if (group_size > 1) printf("%s ", group[i].name);
+                    printf("%d %d%c", group[i].cur_brightness, group[i].max_brightness,
+                           i == group_size-1 ? '\n' : ' ');
+                }
+                break;
+            case COMMAND_SET:
+            case COMMAND_FADE:
+                ret = prepare_command(group, group_size, cmd, false, targets);
+                if (ret == 0 && batch && cmd->type == COMMAND_SET) {
+                    pending_group = group;
+                    pending_group_size = group_size;
+                    num_pending = 1;
+                    continue;
+                }
+                if (ret == 0) {
+                    ret = apply_command(b, group, group_size, cmd->seconds,
+                                        steps_per_sec, jnd_percent, on_external,
+                                        stats, 1);
+                    if (ret < 0) status = -1;
+                    fflush(stdout);
+                    continue;
+                }
+                break;
+            case COMMAND_SLEEP: {
+                struct timespec deadline;
+                clock_gettime(CLOCK_BOOTTIME, &deadline);
+                add_nanoseconds_to_timespec(&deadline,
+                    (long)(cmd->seconds * NANOSEC_PER_SEC), &deadline);
+                while (!received_signal
+                       && clock_nanosleep(CLOCK_BOOTTIME, TIMER_ABSTIME,
+                                          &deadline, NULL) == EINTR) ;
+                break;
+            }
+            default:
+                break;
+        }
+done:
+        if (ret < 0) status = -1;
+        if (ret < 0 || cmd->type != COMMAND_GET) print_command_result(ret);
+        fflush(stdout);
+    }
+    if (num_pending > 0 && !received_signal) {
+        if (apply_command(b, pending_group, pending_group_size, 0,
+                          steps_per_sec, jnd_percent, on_external,
+                          stats, num_pending) < 0)
+        {
+            status = -1;
+        }
+        fflush(stdout);
+    }
+
+finish:
+    free(reader);
+    free(cmd);
+    free(targets);
+    return status;
+}
+
+#ifdef WITH_KEYS
+// Whether an evdev device has either of the brightness keys
+bool has_brightness_keys(int fd) {
+    unsigned long bits[KEY_MAX / (8*sizeof(unsigned long)) + 1] = {0};
+    const int word_bits = 8*sizeof(unsigned long);
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits) < 0) return false;
+    return (bits[KEY_BRIGHTNESSUP / word_bits] >> (KEY_BRIGHTNESSUP % word_bits) & 1)
+        || (bits[KEY_BRIGHTNESSDOWN / word_bits] >> (KEY_BRIGHTNESSDOWN % word_bits) & 1);
+}
+
+int add_key_source(struct pollfd **pfds, int *num_pfds, int fd) {
+    struct pollfd *new_pfds = realloc(*pfds, (*num_pfds+1) * sizeof(**pfds));
+    if (!new_pfds) {
+        perror("realloc");
+        close(fd);
+        return -1;
+    }
+    *pfds = new_pfds;
+    new_pfds[*num_pfds].fd = fd;
+    new_pfds[*num_pfds].events = POLLIN;
+    (*num_pfds)++;
+    return 0;
+}
+
+// Open the comma separated list of event sources, which may be evdev
+// devices, FIFOs or files of recorded events. Without a list, open every
+// evdev device which has brightness keys.
+int open_key_sources(const char *list, struct pollfd **pfds, int *num_pfds) {
+    char path[PATH_MAX];
+    if (list) {
+        while (*list) {
+            size_t len = strcspn(list, ",");
+            if (len >= sizeof(path)) {
+                LOG_ERROR("File path is too long\n");
+                return -1;
+            }
+            memcpy(path, list, len);
+            path[len] = '\0';
+            list += len + (list[len] == ',');
+            if (len == 0) continue;
+            int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd < 0) {
+                LOG_ERROR("Could not open %s: %s\n", path, strerror(errno));
+                return -1;
+            }
+            LOG_INFO("Reading keys from %s\n", path);
+            if (add_key_source(pfds, num_pfds, fd) < 0) return -1;
+        }
+        return 0;
+    }
+
+    DIR *dir = opendir("/dev/input");
+    if (!dir) {
+        LOG_ERROR("Could not open /dev/input: %s\n", strerror(errno));
+        return -1;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (strncmp(ent->d_name, "event", 5) != 0) continue;
+        int fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            LOG_INFO("Could not open /dev/input/%s: %s\n", ent->d_name, strerror(errno));
+            continue;
+        }
+        if (!has_brightness_keys(fd)) {
+            close(fd);
+            continue;
+        }
+        LOG_INFO("Reading keys from /dev/input/%s\n", ent->d_name);
+        if (add_key_source(pfds, num_pfds, fd) < 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    if (*num_pfds == 0) {
+        LOG_ERROR("No readable input device has brightness keys\n");
+        return -1;
+    }
+    return 0;
+}
+
+// The size of a step in percent, growing while a key is held so that
+// sweeping across the whole range doesn't take long
+float key_step_percent(float step_percent, int repeats) {
+    int factor = 1 + repeats / KEY_ACCEL_REPEATS;
+    if (factor > KEY_ACCEL_MAX_FACTOR) factor = KEY_ACCEL_MAX_FACTOR;
+    return step_percent * factor;
+}
+
+// Add the steps of the brightness key events to *percent
+void read_key_events(const struct input_event *events, int num_events,
+                     float step_percent, int *repeats, float *percent)
+{
+    for (int i = 0; i < num_events; i++) {
+        const struct input_event *ev = &events[i];
+        if (ev->type != EV_KEY) continue;
+        if (ev->code != KEY_BRIGHTNESSUP && ev->code != KEY_BRIGHTNESSDOWN) continue;
+        if (ev->value == 0) continue;   // released
+        // 1 is a press, 2 an autorepeat
+        *repeats = ev->value == 2 ? *repeats + 1 : 0;
+        float step = key_step_percent(step_percent, *repeats);
+        *percent += ev->code == KEY_BRIGHTNESSUP ? step : -step;
+    }
+}
+
+// Events read from a key source. A FIFO or file may hand out part of an
+// event, which is kept until the rest arrives; evdev devices only ever
+// return whole ones.
+struct key_buffer {
+    struct input_event events[64];
+    size_t len;     // in bytes
+};
+
+// Step a device by percent of its maximum, from the target of the previous
+// change, staying within range
+int step_device(struct backend *b, struct device *dev, float percent,
+                struct fade_stats *stats)
+{
+    int base, target;
+
+    if (read_brightness(dev, &dev->cur_brightness, &dev->max_brightness) < 0
+        || get_base_brightness(dev, dev->cur_brightness, dev->max_brightness,
+                               &base) < 0)
+    {
+        return -1;
+    }
+    int step = lround(dev->max_brightness * percent / 100);
+    if (step == 0) step = percent > 0 ? 1 : -1;
+    target = base + step;
+    if (target < 0) target = 0;
+    if (target > dev->max_brightness) target = dev->max_brightness;
+    LOG_INFO("Stepping %s from %d to %d\n", dev->name, base, target);
+    return set_device(b, dev, target, stats);
+}
+
+// Stay resident and handle the brightness keys. The events which have
+// arrived by the time the previous change is done are combined into one
+// step. Returns when a signal is received or every source has ended.
+int run_keys(struct backend *b, struct device *devices, int num_devices,
+             const char *sources, float step_percent, struct fade_stats *stats)
+{
+    struct pollfd *pfds = NULL;
+    struct key_buffer *bufs = NULL;
+    int num_pfds = 0, num_open, repeats = 0;
+    int status = open_key_sources(sources, &pfds, &num_pfds);
+    num_open = num_pfds;
+    if (status == 0) {
+        bufs = calloc(num_pfds, sizeof(*bufs));
+        if (!bufs) {
+            perror("calloc");
+            status = -1;
+        }
+    }
+
+    while (status == 0 && !received_signal && num_open > 0) {
+        if (poll(pfds, num_pfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            status = -1;
+            break;
+        }
+        float percent = 0;
+        for (int i = 0; i < num_pfds; i++) {
+            struct key_buffer *buf = &bufs[i];
+            if (pfds[i].fd < 0 || !pfds[i].revents) continue;
+            ssize_t n = read(pfds[i].fd, (char *)buf->events + buf->len,
+                             sizeof(buf->events) - buf->len);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (n <= 0) {
+                // End of a recorded file, or the device was unplugged
+                if (n < 0) LOG_INFO("Stopped reading keys: %s\n", strerror(errno));
+                if (buf->len > 0) {
+                    LOG_ERROR("Key source ended in the middle of an event\n");
+                }
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                num_open--;
+                continue;
+            }
+            buf->len += n;
+            size_t num_events = buf->len / sizeof(*buf->events);
+            read_key_events(buf->events, num_events, step_percent,
+                            &repeats, &percent);
+            buf->len -= num_events * sizeof(*buf->events);
+            memmove(buf->events, &buf->events[num_events], buf->len);
+        }
+        if (percent == 0) continue;
+        for (int i = 0; i < num_devices; i++) {
+            // A failed step isn't fatal; the next key press tries again
+            step_device(b, &devices[i], percent, stats);
+        }
+    }
+
+    for (int i = 0; i < num_pfds; i++) {
+        if (pfds[i].fd >= 0) close(pfds[i].fd);
+    }
+    free(bufs);
+    free(pfds);
+    return status;
+}
+#endif
+
+#ifdef WITH_IDLE
+// The session's IdleHint as last reported by logind
+static bool session_idle = false;
+// Whether a dim fade is running, and whether the session became active
+// during it, which interrupts the fade like a signal would
+static bool dimming = false;
+static bool woke_during_dim = false;
+
+int get_idle_hint(sd_bus *bus, const struct session *session, bool *idle) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    int value = 0;
+    int ret = sd_bus_get_property_trivial(bus, "org.freedesktop.login1",
+                                          session->path,
+                                          "org.freedesktop.login1.Session",
+                                          "IdleHint", &error, 'b', &value);
+    if (ret < 0) {
+        log_method_call_failed(&error);
+        sd_bus_error_free(&error);
+        return ret;
+    }
+    *idle = value;
+    return 0;
+}
+
+// PropertiesChanged of the session. Finding IdleHint in the signal would
+// mean walking a dict of variants, so it is asked for instead; this only
+// happens when a property of the session actually changed.
+int idle_hint_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    struct backend *b = userdata;
+    const char *interface;
+    bool idle;
+    if (sd_bus_message_read(m, "s", &interface) <= 0
+        || strcmp(interface, "org.freedesktop.login1.Session") != 0
+        || get_idle_hint(b->bus, &b->session, &idle) < 0
+        || idle == session_idle)
+    {
+        return 0;
+    }
+    LOG_INFO("Session is %s\n", idle ? "idle" : "active again");
+    session_idle = idle;
+    if (!idle && dimming) {
+        woke_during_dim = true;
+        interrupted = true;
+    }
+    return 0;
+}
+
+// Fade the devices to idle_str once the session goes idle, as if we had
+// been run with it. Returns false if the session became active again
+// before the fade was done, in which case the fade has already put them
+// back. Devices which can't be dimmed are left alone until then.
+bool dim_devices(struct backend *b, struct device *devices, int num_devices,
+                 const char *idle_str, float countdown_sec, int steps_per_sec,
+                 float jnd_percent, enum external_policy on_external,
+                 struct fade_stats *stats, int *targets)
+{
+    struct command cmd = {.type = COMMAND_FADE, .value = idle_str,
+                          .seconds = countdown_sec};
+    if (prepare_command(devices, num_devices, &cmd, false, targets) < 0) {
+        for (int i = 0; i < num_devices; i++) {
+            devices[i].overridden = true;
+        }
+        return true;
+    }
+    dimming = true;
+    apply_command(b, devices, num_devices, countdown_sec, steps_per_sec,
+                  jnd_percent, on_external, stats, 0);
+    dimming = false;
+    interrupted = false;
+    if (woke_during_dim && !superseded) {
+        woke_during_dim = false;
+        return false;
+    }
+    return true;
+}
+
+// Put the devices back to where they were before dimming, unless someone
+// changed them in the meantime
+void undim_devices(struct backend *b, struct device *devices, int num_devices,
+                   struct fade_stats *stats)
+{
+    for (int i = 0; i < num_devices; i++) {
+        struct device *dev = &devices[i];
+        int dimmed_to = dev->target_brightness;
+        if (dev->overridden
+            || read_brightness(dev, &dev->cur_brightness,
+                               &dev->max_brightness) < 0)
+        {
+            continue;
+        }
+        if (dev->cur_brightness != dimmed_to) {
+            LOG_INFO("%s was changed while idle, not restoring it\n", dev->name);
+            continue;
+        }
+        set_device(b, dev, dev->orig_brightness, stats);
+    }
+}
+
+// Stay resident, dimming the devices while logind reports the session as
+// idle. This is driven entirely by the session's PropertiesChanged
+// signals on the bus connection used for everything else.
+int run_idle(struct backend *b, struct device *devices, int num_devices,
+             const char *idle_str, float countdown_sec, int steps_per_sec,
+             float jnd_percent, enum external_policy on_external,
+             struct fade_stats *stats)
+{
+    bool dimmed = false;
+    int status = 0, ret;
+    int *targets = malloc(num_devices * sizeof(*targets));
+    if (!targets) {
+        perror("malloc");
+        return -1;
+    }
+    if (!b->session.path && open_bus(&b->bus, &b->session) < 0) {
+        free(targets);
+        return -1;
+    }
+    ret = sd_bus_match_signal(b->bus, NULL, "org.freedesktop.login1",
+                              b->session.path, "org.freedesktop.DBus.Properties",
+                              "PropertiesChanged", idle_hint_changed, b);
+    if (ret < 0) {
+        LOG_ERROR("Failed to subscribe to session changes: %s\n", strerror(-ret));
+        free(targets);
+        return -1;
+    }
+    if (get_idle_hint(b->bus, &b->session, &session_idle) < 0) {
+        free(targets);
+        return -1;
+    }
+
+    while (!received_signal) {
+        if (process_bus(b->bus) < 0) {
+            status = -1;
+            break;
+        }
+        if (session_idle && !dimmed) {
+            LOG_INFO("Dimming\n");
+            dimmed = dim_devices(b, devices, num_devices, idle_str, countdown_sec,
+                                 steps_per_sec, jnd_percent, on_external, stats,
+                                 targets);
+            continue;
+        }
+        if (!session_idle && dimmed) {
+            LOG_INFO("Restoring brightness\n");
+            undim_devices(b, devices, num_devices, stats);
+            dimmed = false;
+            continue;
+        }
+        ret = sd_bus_wait(b->bus, UINT64_MAX);
+        if (ret < 0 && ret != -EINTR) {
+            LOG_ERROR("Failed to wait on bus: %s\n", strerror(-ret));
+            status = -1;
+            break;
+        }
+    }
+    // Don't leave the screen dim when we are stopped
+    if (dimmed && !superseded) {
+        received_signal = false;
+        undim_devices(b, devices, num_devices, stats);
+    }
+    free(targets);
+    return status;
+}
+#endif
+
+#ifdef WITH_AUTO
+// An ambient light sensor of the IIO subsystem. Readings come from its
+// buffered character device if it has one, and otherwise from polling
+// its sysfs attribute.
+struct als {
+    int dfd;                // the device's sysfs directory
+    const char *attribute;  // in_illuminance_input (lux) or _raw
+    double scale;
+    double offset;
+    int buffer_fd;          // -1 when polling
+    bool enabled_buffer;    // we turned the buffer on, and must turn it off
+    bool enabled_channel;   // likewise for the illuminance channel
+    bool set_trigger;       // likewise for the trigger
+    // Where the illuminance is in each scan of the buffer
+    size_t scan_bytes;
+    size_t value_offset;
+    int value_bytes;
+    int value_bits;
+    int value_shift;
+    bool value_signed;
+    bool value_big_endian;
+};
+
+// A point of the curve mapping lux to brightness
+struct lux_point {
+    double lux;
+    double percent;
+};
+
+// Parse a curve of the form LUX:PERCENT,... with increasing lux
+int read_als_curve(const char *s, struct lux_point *points, int *num_points) {
+    *num_points = 0;
+    while (*s) {
+        struct lux_point *p = &points[*num_points];
+        char *endptr;
+        if (*num_points == ALS_CURVE_MAX_POINTS) goto invalid;
+        p->lux = strtod(s, &endptr);
+        if (endptr == s || *endptr != ':' || p->lux < 0) goto invalid;
+        s = endptr + 1;
+        p->percent = strtod(s, &endptr);
+        if (endptr == s || (*endptr != ',' && *endptr != '\0')
+            || p->percent < 0 || p->percent > 100)
+        {
+            goto invalid;
+        }
+        if (*num_points > 0 && p->lux <= points[*num_points-1].lux) goto invalid;
+        (*num_points)++;
+        s = endptr + (*endptr == ',');
+    }
+    if (*num_points > 0) return 0;
+invalid:
+    LOG_ERROR("Invalid curve (must be LUX:PERCENT,... with increasing LUX)\n");
+    return -1;
+}
+
+// Interpolate the curve linearly in log(lux), which is closer to how
+// brightness is perceived
+double lux_to_percent(const struct lux_point *points, int num_points, double lux) {
+    if (lux <= points[0].lux) return points[0].percent;
+    for (int i = 1; i < num_points; i++) {
+        if (lux > points[i].lux) continue;
+        double x0 = log1p(points[i-1].lux), x1 = log1p(points[i].lux);
+        double t = (log1p(lux) - x0) / (x1 - x0);
+        return points[i-1].percent + t * (points[i].percent - points[i-1].percent);
+    }
+    return points[num_points-1].percent;
+}
+
+int write_attribute_at(int dfd, const char *dir, const char *attribute,
+                       const char *value)
+{
+    char path[NAME_MAX+32];
+    snprintf(path, sizeof(path), "%s/%s", dir, attribute);
+    int fd = openat(dfd, path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, value, strlen(value));
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+// Find the first IIO device with an illuminance channel
+int find_als(char *path, size_t size) {
+    DIR *dir = opendir(IIO_DEVICES_DIR);
+    struct dirent *ent;
+    char buf[32];
+    if (!dir) {
+        LOG_ERROR("Could not open " IIO_DEVICES_DIR ": %s\n", strerror(errno));
+        return -1;
+    }
+    while ((ent = readdir(dir))) {
+        if (strncmp(ent->d_name, "iio:device", 10) != 0) continue;
+        if (read_attribute_at(dirfd(dir), ent->d_name, "in_illuminance_raw",
+                              buf, sizeof(buf)) < 0
+            && read_attribute_at(dirfd(dir), ent->d_name, "in_illuminance_input",
+                                 buf, sizeof(buf)) < 0)
+        {
+            continue;
+        }
+        snprintf(path, size, IIO_DEVICES_DIR "/%s", ent->d_name);
+        closedir(dir);
+        return 0;
+    }
+    closedir(dir);
+    LOG_ERROR("No ambient light sensor found\n");
+    return -1;
+}
+
+// Parse a channel type such as "le:u12/16>>4". The repeat count is
+// multiplied into bytes.
+bool parse_scan_type(const char *type, char *endianness, char *sign,
+                     int *bits, int *bytes, int *shift)
+{
+    int storage_bits, repeat = 1, n = 0;
+    if (sscanf(type, "%ce:%c%d/%d%n", endianness, sign, bits, &storage_bits, &n) != 4) {
+        return false;
+    }
+    type += n;
+    if (*type == 'X' && sscanf(type, "X%d%n", &repeat, &n) == 1) type += n;
+    if (sscanf(type, ">>%d", shift) != 1) return false;
+    if (storage_bits % 8 || storage_bits == 0 || storage_bits > 64 || *bits > storage_bits) {
+        return false;
+    }
+    *bytes = storage_bits / 8 * repeat;
+    return true;
+}
+
+// Work out where the illuminance is in each scan, given all enabled
+// channels. Like the kernel, each channel is aligned to its own size and
+// the scan to the largest one.
+int read_scan_layout(struct als *als) {
+    int dfd = openat(als->dfd, "scan_elements", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = dfd >= 0 ? fdopendir(dfd) : NULL;
+    struct {
+        int index;
+        int bytes;
+        bool ours;
+    } channels[ALS_SCAN_MAX_CHANNELS];
+    int num_channels = 0;
+    struct dirent *ent;
+    if (!dir) {
+        if (dfd >= 0) close(dfd);
+        return -1;
+    }
+    while ((ent = readdir(dir))) {
+        char name[NAME_MAX+1], attribute[NAME_MAX+8], buf[64];
+        size_t len = strlen(ent->d_name);
+        int enabled;
+        if (len < 4 || strcmp(ent->d_name + len - 3, "_en") != 0) continue;
+        if (read_int_attribute_at(dirfd(dir), ".", ent->d_name, &enabled) < 0
+            || !enabled)
+        {
+            continue;
+        }
+        if (num_channels == ALS_SCAN_MAX_CHANNELS) goto fail;
+        memcpy(name, ent->d_name, len - 3);
+        name[len - 3] = '\0';
+        snprintf(attribute, sizeof(attribute), "%s_index", name);
+        if (read_int_attribute_at(dirfd(dir), ".", attribute,
+                                  &channels[num_channels].index) < 0)
+        {
+            goto fail;
+        }
+        snprintf(attribute, sizeof(attribute), "%s_type", name);
+        char endianness, sign;
+        int bits, bytes, shift;
+        if (read_attribute_at(dirfd(dir), ".", attribute, buf, sizeof(buf)) < 0
+            || !parse_scan_type(buf, &endianness, &sign, &bits, &bytes, &shift))
+        {
+            goto fail;
+        }
+        channels[num_channels].bytes = bytes;
+        channels[num_channels].ours = strcmp(name, "in_illuminance") == 0;
+        if (channels[num_channels].ours) {
+            if (bytes > 8) goto fail;
+            als->value_bytes = bytes;
+            als->value_bits = bits;
+            als->value_shift = shift;
+            als->value_signed = sign == 's';
+            als->value_big_endian = endianness == 'b';
+        }
+        num_channels++;
+    }
+    closedir(dir);
+
+    size_t offset = 0, largest = 1;
+    bool found = false;
+    for (int done = 0; done < num_channels; done++) {
+        // Channels are laid out by index
+        int next = -1;
+        for (int i = 0; i < num_channels; i++) {
+            if (channels[i].bytes == 0) continue;
+            if (next < 0 || channels[i].index < channels[next].index) next = i;
+        }
+        size_t bytes = channels[next].bytes;
+        offset = (offset + bytes - 1) / bytes * bytes;
+        if (channels[next].ours) {
+            als->value_offset = offset;
+            found = true;
+        }
+        offset += bytes;
+        if (bytes > largest) largest = bytes;
+        channels[next].bytes = 0;
+    }
+    als->scan_bytes = (offset + largest - 1) / largest * largest;
+    return found ? 0 : -1;
+fail:
+    closedir(dir);
+    return -1;
+}
+
+// Pick a trigger for the sensor unless it has one. Drivers name their own
+// triggers after the device and its number, e.g. "als-dev0" for
+// iio:device0.
+int set_als_trigger(struct als *als, const char *sensor_path) {
+    char current[NAME_MAX+1], name[NAME_MAX+1], trigger[NAME_MAX+1];
+    char wanted[2*NAME_MAX+16];
+    const char *base = strrchr(sensor_path, '/');
+    int index;
+    if (read_attribute_at(als->dfd, "trigger", "current_trigger",
+                          current, sizeof(current)) < 0)
+    {
+        // The device doesn't use triggers
+        return 0;
+    }
+    if (current[0]) return 0;
+    if (read_attribute_at(als->dfd, ".", "name", name, sizeof(name)) <= 0
+        || sscanf(base ? base+1 : sensor_path, "iio:device%d", &index) != 1)
+    {
+        return -1;
+    }
+    snprintf(wanted, sizeof(wanted), "%s-dev%d", name, index);
+    DIR *dir = opendir(IIO_DEVICES_DIR);
+    struct dirent *ent;
+    int status = -1;
+    if (!dir) return -1;
+    while ((ent = readdir(dir))) {
+        if (strncmp(ent->d_name, "trigger", 7) != 0) continue;
+        if (read_attribute_at(dirfd(dir), ent->d_name, "name",
+                              trigger, sizeof(trigger)) <= 0
+            || strcmp(trigger, wanted) != 0)
+        {
+            continue;
+        }
+        status = write_attribute_at(als->dfd, "trigger", "current_trigger", trigger);
+        if (status == 0) {
+            LOG_INFO("Using trigger %s\n", trigger);
+            als->set_trigger = true;
+        }
+        break;
+    }
+    closedir(dir);
+    return status;
+}
+
+// Turn off what open_als_buffer() turned on. The channel and trigger can
+// only be changed while the buffer is off.
+void disable_als_buffer(struct als *als) {
+    if (als->enabled_buffer) write_attribute_at(als->dfd, "buffer", "enable", "0");
+    if (als->enabled_channel) {
+        write_attribute_at(als->dfd, "scan_elements", "in_illuminance_en", "0");
+    }
+    // A name which matches no trigger detaches it
+    if (als->set_trigger) {
+        write_attribute_at(als->dfd, "trigger", "current_trigger", "\n");
+    }
+    als->enabled_buffer = false;
+    als->enabled_channel = false;
+    als->set_trigger = false;
+}
+
+// Set up buffered reads: enable the illuminance channel, pick a trigger
+// and turn the buffer on, unless someone else already did. Whatever we
+// turned on is turned back off on failure, and the caller falls back to
+// polling.
+int open_als_buffer(struct als *als, const char *sensor_path,
+                    const char *buffer_path)
+{
+    char path[PATH_MAX], buf[32];
+    int enabled;
+    if (read_int_attribute_at(als->dfd, "buffer", "enable", &enabled) < 0) {
+        LOG_INFO("Sensor has no buffer\n");
+        return -1;
+    }
+    if (!enabled) {
+        if (read_attribute_at(als->dfd, "scan_elements", "in_illuminance_en",
+                              buf, sizeof(buf)) < 0)
+        {
+            LOG_INFO("Sensor has no illuminance channel in its buffer\n");
+            return -1;
+        }
+        if (strcmp(buf, "1") != 0) {
+            if (write_attribute_at(als->dfd, "scan_elements",
+                                   "in_illuminance_en", "1") < 0)
+            {
+                goto setup_failed;
+            }
+            als->enabled_channel = true;
+        }
+        if (set_als_trigger(als, sensor_path) < 0
+            || write_attribute_at(als->dfd, "buffer", "enable", "1") < 0)
+        {
+            goto setup_failed;
+        }
+        als->enabled_buffer = true;
+    } else if (read_attribute_at(als->dfd, "scan_elements", "in_illuminance_en",
+                                 buf, sizeof(buf)) < 0 || strcmp(buf, "1") != 0)
+    {
+        LOG_INFO("Sensor's buffer is in use without illuminance\n");
+        return -1;
+    }
+    if (read_scan_layout(als) < 0) {
+        LOG_INFO("Could not work out the sensor's scan layout\n");
+        goto fail;
+    }
+    if (!buffer_path) {
+        const char *base = strrchr(sensor_path, '/');
+        snprintf(path, sizeof(path), "/dev/%s", base ? base+1 : sensor_path);
+        buffer_path = path;
+    }
+    als->buffer_fd = open(buffer_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (als->buffer_fd < 0) {
+        LOG_INFO("Could not open %s: %s\n", buffer_path, strerror(errno));
+        goto fail;
+    }
+    LOG_INFO("Reading the sensor through %s\n", buffer_path);
+    return 0;
+setup_failed:
+    LOG_INFO("Could not set up the sensor's buffer: %s\n", strerror(errno));
+fail:
+    disable_als_buffer(als);
+    return -1;
+}
+
+int open_als(const char *sensor_path, const char *buffer_path, struct als *als) {
+    char buf[32], found_path[PATH_MAX];
+    memset(als, 0, sizeof(*als));
+    als->dfd = -1;
+    als->buffer_fd = -1;
+    if (!sensor_path) {
+        if (find_als(found_path, sizeof(found_path)) < 0) return -1;
+        sensor_path = found_path;
+    }
+    LOG_INFO("Using ambient light sensor %s\n", sensor_path);
+    als->dfd = open(sensor_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (als->dfd < 0) {
+        LOG_ERROR("Could not open %s: %s\n", sensor_path, strerror(errno));
+        return -1;
+    }
+    // The processed value is in lux already
+    als->scale = 1;
+    als->offset = 0;
+    if (read_attribute_at(als->dfd, ".", "in_illuminance_input", buf, sizeof(buf)) >= 0) {
+        als->attribute = "in_illuminance_input";
+    } else {
+        als->attribute = "in_illuminance_raw";
+    }
+    if (read_attribute_at(als->dfd, ".", "in_illuminance_scale", buf, sizeof(buf)) > 0) {
+        als->scale = strtod(buf, NULL);
+    }
+    if (read_attribute_at(als->dfd, ".", "in_illuminance_offset", buf, sizeof(buf)) > 0) {
+        als->offset = strtod(buf, NULL);
+    }
+    if (open_als_buffer(als, sensor_path, buffer_path) < 0) {
+        LOG_INFO("Polling %s\n", als->attribute);
+    }
+    return 0;
+}
+
+void close_als(struct als *als) {
+    if (als->buffer_fd >= 0) close(als->buffer_fd);
+    disable_als_buffer(als);
+    if (als->dfd >= 0) close(als->dfd);
+}
+
+// Take the illuminance out of a scan
+double decode_scan(const struct als *als, const unsigned char *scan) {
+    uint64_t v = 0;
+    for (int i = 0; i < als->value_bytes; i++) {
+        int byte = als->value_big_endian ? i : als->value_bytes - 1 - i;
+        v = v << 8 | scan[als->value_offset + byte];
+    }
+    v >>= als->value_shift;
+    if (als->value_bits < 64) v &= ((uint64_t)1 << als->value_bits) - 1;
+    if (als->value_signed && als->value_bits < 64
+        && v >> (als->value_bits - 1))
+    {
+        return (double)(int64_t)(v | ~(((uint64_t)1 << als->value_bits) - 1));
+    }
+    return (double)v;
+}
+
+// Read the latest illuminance in lux. Returns 0 if the buffer has nothing
+// new; the kernel only ever hands out whole scans.
+int read_als(struct als *als, double *lux) {
+    double raw;
+    if (als->buffer_fd >= 0) {
+        unsigned char scans[ALS_READ_BUFFER_SIZE];
+        size_t want = sizeof(scans) / als->scan_bytes * als->scan_bytes;
+        if (want == 0) return -1;
+        ssize_t n = read(als->buffer_fd, scans, want);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            LOG_ERROR("Could not read the sensor: %s\n", strerror(errno));
+            return -1;
+        }
+        if ((size_t)n < als->scan_bytes) return 0;
+        // Only the most recent scan matters
+        raw = decode_scan(als, scans + (n / als->scan_bytes - 1) * als->scan_bytes);
+    } else {
+        char buf[32], *endptr;
+        if (read_attribute_at(als->dfd, ".", als->attribute, buf, sizeof(buf)) <= 0) {
+            LOG_ERROR("Could not read %s\n", als->attribute);
+            return -1;
+        }
+        raw = strtod(buf, &endptr);
+        if (endptr == buf) return -1;
+    }
+    *lux = (raw + als->offset) * als->scale;
+    return 1;
+}
+
+// Fade the devices to percent of their maximum, unless the change would be
+// imperceptible
+void follow_light(struct backend *b, struct device *devices, int num_devices,
+                  double percent, float countdown_sec, int steps_per_sec,
+                  float jnd_percent, enum external_policy on_external,
+                  struct fade_stats *stats)
+{
+    for (int i = 0; i < num_devices; i++) {
+        struct device *dev = &devices[i];
+        char value[16];
+        if (read_brightness(dev, &dev->cur_brightness,
+                            &dev->max_brightness) < 0)
+        {
+            dev->target_brightness = dev->cur_brightness;
+            continue;
+        }
+        int target = lround(dev->max_brightness * percent / 100);
+        snprintf(value, sizeof(value), "%d", target);
+        if (!is_perceptible_step(dev->cur_brightness, target, jnd_percent)
+            || claim_target(dev, value, countdown_sec, target) < 0)
+        {
+            dev->target_brightness = dev->cur_brightness;
+        }
+    }
+    apply_command(b, devices, num_devices, countdown_sec, steps_per_sec,
+                  jnd_percent, on_external, stats, 0);
+}
+
+// Stay resident and follow the ambient light. Small changes of light and
+// of brightness are ignored so that flicker and sensor noise don't turn
+// into method calls. Returns when a signal is received or the buffer ends.
+int run_auto(struct backend *b, struct device *devices, int num_devices,
+             struct als *als, const struct lux_point *curve, int num_points,
+             float countdown_sec, int steps_per_sec, float jnd_percent,
+             enum external_policy on_external, struct fade_stats *stats)
+{
+    double ref_lux = -1, lux;
+    int poll_millis = ALS_POLL_MIN_MILLIS;
+    int status = 0;
+    if (jnd_percent == 0) jnd_percent = DEFAULT_ALS_JND_PERCENT;
+
+    while (!received_signal) {
+        // The buffer wakes us up with each scan, even before the first
+        if (als->buffer_fd >= 0) {
+            struct pollfd pfd = {.fd = als->buffer_fd, .events = POLLIN};
+            if (poll(&pfd, 1, -1) < 0) {
+                if (errno == EINTR) continue;
+                perror("poll");
+                status = -1;
+                break;
+            }
+            if (pfd.revents == POLLHUP) {
+                // Only a FIFO standing in for the buffer ends
+                LOG_INFO("The sensor's buffer was closed\n");
+                break;
+            }
+        }
+        int ret = read_als(als, &lux);
+        if (ret < 0) {
+            status = -1;
+            break;
+        }
+        if (ret > 0) {
+            double band = ref_lux * ALS_HYSTERESIS_PERCENT / 100 + ALS_HYSTERESIS_MIN_LUX;
+            if (ref_lux >= 0 && fabs(lux - ref_lux) <= band) {
+                if (poll_millis < ALS_POLL_MAX_MILLIS) poll_millis *= 2;
+            } else {
+                double percent = lux_to_percent(curve, num_points, lux);
+                LOG_INFO("%.1f lux, aiming for %.1f%%\n", lux, percent);
+                ref_lux = lux;
+                poll_millis = ALS_POLL_MIN_MILLIS;
+                follow_light(b, devices, num_devices, percent, countdown_sec,
+                             steps_per_sec, jnd_percent, on_external, stats);
+                if (superseded) break;
+            }
+        }
+        if (als->buffer_fd < 0) poll(NULL, 0, poll_millis);
+    }
+    return status;
+}
+#endif
+
+#ifdef WITH_SCHEDULE
+// A transition of the schedule, at a local time of day
+struct schedule_event {
+    int second_of_day;
+    float countdown_sec;    // negative for the -t countdown
+    char value[16];
+};
+
+int compare_schedule_events(const void *a, const void *b) {
+    return ((const struct schedule_event *)a)->second_of_day
+        - ((const struct schedule_event *)b)->second_of_day;
+}
+
+// Parse a line of the form HH:MM[:SS] BRIGHTNESS [COUNTDOWN]. Returns 0
+// for a blank line or comment, 1 for an event and -1 if it's invalid.
+int parse_schedule_line(char *line, struct schedule_event *ev) {
+    char *time_str, *value, *countdown_str, *saveptr;
+    int hour, minute, second = 0, n = 0, target;
+    line[strcspn(line, "#\n")] = '\0';
+    time_str = strtok_r(line, " \t", &saveptr);
+    if (!time_str) return 0;
+    value = strtok_r(NULL, " \t", &saveptr);
+    countdown_str = strtok_r(NULL, " \t", &saveptr);
+    if (!value || strtok_r(NULL, " \t", &saveptr)) return -1;
+    if ((sscanf(time_str, "%2d:%2d%n:%2d%n", &hour, &minute, &n, &second, &n) < 2)
+        || time_str[n] != '\0' || hour > 23 || minute > 59 || second > 59
+        || hour < 0 || minute < 0 || second < 0)
+    {
+        return -1;
+    }
+    // Relative values would depend on when the program was started. The
+    // range of absolute ones can only be checked against each device.
+    if (value[0] == '+' || value[0] == '-' || strlen(value) >= sizeof(ev->value)
+        || calculate_target_brightness(value, 0, strchr(value, '%') ? 100 : INT_MAX,
+                                       &target) < 0)
+    {
+        return -1;
+    }
+    ev->countdown_sec = -1;
+    if (countdown_str && read_countdown(countdown_str, &ev->countdown_sec) < 0) {
+        return -1;
+    }
+    ev->second_of_day = (hour * 60 + minute) * 60 + second;
+    strcpy(ev->value, value);
+    return 1;
+}
+
+// Read the schedule into an array sorted by time of day
+int read_schedule(const char *path, struct schedule_event **res, int *count) {
+    FILE *f = fopen(path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    int line_num = 0, status = 0;
+    *res = NULL;
+    *count = 0;
+    if (!f) {
+        LOG_ERROR("Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (getline(&line, &size, f) >= 0) {
+        struct schedule_event ev;
+        line_num++;
+        int ret = parse_schedule_line(line, &ev);
+        if (ret == 0) continue;
+        if (ret < 0) {
+            LOG_ERROR("%s:%d: invalid line (must be HH:MM[:SS] BRIGHTNESS "
+                      "[COUNTDOWN] with an absolute BRIGHTNESS)\n", path, line_num);
+            status = -1;
+            break;
+        }
+        struct schedule_event *events = realloc(*res, (*count + 1) * sizeof(*events));
+        if (!events) {
+            perror("realloc");
+            status = -1;
+            break;
+        }
+        *res = events;
+        (*res)[(*count)++] = ev;
+    }
+    free(line);
+    fclose(f);
+    if (status == 0 && *count == 0) {
+        LOG_ERROR("%s has no events\n", path);
+        status = -1;
+    }
+    if (status < 0) {
+        free(*res);
+        *res = NULL;
+        return -1;
+    }
+    qsort(*res, *count, sizeof(**res), compare_schedule_events);
+    return 0;
+}
+
+// When an event happens on the day which is day_offset days from now, in
+// local time. mktime() takes care of DST.
+time_t schedule_event_time(const struct schedule_event *ev, time_t now,
+                           int day_offset)
+{
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_mday += day_offset;
+    tm.tm_hour = ev->second_of_day / 3600;
+    tm.tm_min = ev->second_of_day / 60 % 60;
+    tm.tm_sec = ev->second_of_day % 60;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// Find the latest event at or before now and the first one after it
+void find_schedule_events(const struct schedule_event *events, int num_events,
+                          time_t now, int *current, time_t *current_time,
+                          int *next, time_t *next_time)
+{
+    *current = *next = -1;
+    for (int day = -1; day <= 1; day++) {
+        for (int i = 0; i < num_events; i++) {
+            time_t t = schedule_event_time(&events[i], now, day);
+            if (t <= now && (*current < 0 || t >= *current_time)) {
+                *current = i;
+                *current_time = t;
+            }
+            if (t > now && (*next < 0 || t < *next_time)) {
+                *next = i;
+                *next_time = t;
+            }
+        }
+    }
+}
+
+// Fade the devices to the brightness of an event
+void run_schedule_event(struct backend *b, struct device *devices,
+                        int num_devices, const char *value, float countdown_sec,
+                        int steps_per_sec, float jnd_percent,
+                        enum external_policy on_external,
+                        struct fade_stats *stats, int *targets)
+{
+    struct command cmd = {.type = COMMAND_FADE, .value = value,
+                          .seconds = countdown_sec};
+    LOG_INFO("Changing to %s over %.1f seconds\n", value, countdown_sec);
+    for (int i = 0; i < num_devices; i++) {
+        if (prepare_command(&devices[i], 1, &cmd, false, &targets[i]) < 0) {
+            // Leave this one alone until the next event
+            devices[i].target_brightness = devices[i].cur_brightness;
+        }
+    }
+    apply_command(b, devices, num_devices, countdown_sec, steps_per_sec,
+                  jnd_percent, on_external, stats, 0);
+}
+
+// Stay resident and change the brightness at the times of day of the
+// schedule. The wait is a single timer on the wall clock for the next
+// event, which the kernel cancels if the clock is set, e.g. by NTP or by
+// hand. Whenever the latest event due isn't the one applied last, as at
+// startup or after the clock jumped past an event, the devices are put to
+// its level over the -t countdown instead of the event's own.
+int run_schedule(struct backend *b, struct device *devices, int num_devices,
+                 const struct schedule_event *events, int num_events,
+                 float countdown_sec, int steps_per_sec, float jnd_percent,
+                 enum external_policy on_external, struct fade_stats *stats)
+{
+    int *targets = malloc(num_devices * sizeof(*targets));
+    int timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+    int status = 0, current, next;
+    time_t current_time, next_time, applied_time = 0, fired_time = 0;
+    bool on_time = false;
+    if (!targets || timer_fd < 0) {
+        perror(targets ? "timerfd_create" : "malloc");
+        status = -1;
+        goto finish;
+    }
+
+    while (!received_signal) {
+        // time() reads a coarse clock which may still be a tick behind the
+        // timer which just fired. Treat the event it fired for as due, or
+        // the timer is armed again in the past and we spin until then.
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec < fired_time) now.tv_sec = fired_time;
+        find_schedule_events(events, num_events, now.tv_sec, &current,
+                             &current_time, &next, &next_time);
+        if (current_time != applied_time) {
+            const struct schedule_event *ev = &events[current];
+            float duration = on_time && ev->countdown_sec >= 0
+                ? ev->countdown_sec : countdown_sec;
+            applied_time = current_time;
+            run_schedule_event(b, devices, num_devices, ev->value, duration,
+                               steps_per_sec, jnd_percent, on_external, stats,
+                               targets);
+            if (superseded) break;
+            // The fade may have taken us past the next event
+            on_time = false;
+            continue;
+        }
+        struct itimerspec its = {.it_value = {.tv_sec = next_time}};
+        if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                            &its, NULL) < 0)
+        {
+            perror("timerfd_settime");
+            status = -1;
+            break;
+        }
+        LOG_INFO("Next change in %lld seconds\n",
+                 (long long)(next_time - now.tv_sec));
+        uint64_t expirations;
+        fired_time = 0;
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+            if (errno == ECANCELED) {
+                LOG_INFO("The clock was set\n");
+            } else if (errno != EINTR) {
+                perror("read");
+                status = -1;
+                break;
+            }
+            continue;
+        }
+        fired_time = next_time;
+        on_time = true;
+    }
+
+finish:
+    if (timer_fd >= 0) close(timer_fd);
+    free(targets);
+    return status;
+}
+#endif
+
+// Returns true if arg is "--name" or "--name=value". *value is set to the
+// text after the '=', or NULL if there is none.
+bool match_long_opt(const char *arg, const char *name, const char **value) {
+    size_t name_len = strlen(name);
+    if (strncmp(arg+2, name, name_len) != 0) return false;
+    if (arg[2+name_len] == '\0') {
+        *value = NULL;
+        return true;
+    }
+    if (arg[2+name_len] == '=') {
+        *value = arg+2+name_len+1;
+        return true;
+    }
+    return false;
+}
+
 int main(int argc, char *argv[]) {
     static const char *usage_fmt_str
         = "Usage: %s [options] [brightness]\n\n"
-          "  -d DEVICE_NAME     e.g. 'intel_backlight'\n"
+          "  -d DEVICE_NAME     e.g. 'intel_backlight' or 'leds/tpacpi::kbd_backlight';\n"
+#ifdef WITH_DDC
+          "                     'ddc/i2c-N' for a monitor over DDC/CI;\n"
+#endif
+          "                     may be a comma separated list, and may be given\n"
+          "                     more than once\n"
           "  -t COUNTDOWN       countdown in seconds \n"
+#ifdef WITH_DBUS
+          "  -x SESSION_ID      systemd-logind session ID\n"
+#endif
           "  -v                 enable debug output\n"
-          "  -h                 show help message and quit\n";
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus *bus = NULL;
-    const char *device_name = NULL,
-               *brightness_str = NULL,
-               *countdown_str = NULL;
-    char *session_object_path = NULL;
-    int orig_brightness,
-        cur_brightness,
-        max_brightness,
-        target_brightness;
-    // TODO: use dynamic delay to prevent clock drift
-    struct timespec delay_ts = {
-        .tv_sec = 0,
-        .tv_nsec = SLEEP_MILLIS * 1000
-    };
+          "  -h                 show help message and quit\n"
+          "  --all              control all backlight devices\n"
+          "  --keyboard         control the keyboard backlights in the leds class\n"
+          "  --prefer=TYPES     order of preference of device types when choosing\n"
+          "                     a device (default: " DEFAULT_TYPE_PREFERENCE ")\n"
+          "  --rate=N           send at most N updates per second while fading\n"
+          "  --jnd=PERCENT      skip fade steps smaller than PERCENT of the level\n"
+          "  --on-external=POLICY\n"
+          "                     what a fade does when the brightness is changed by\n"
+          "                     someone else: abort, retarget or ignore (default)\n"
+          "  --clock=CLOCK      what fades are timed on: boottime (default), which\n"
+          "                     counts time spent suspended, or monotonic\n"
+#ifdef WITH_DBUS
+          "  --on-sleep=POLICY  what a fade does when the system goes to sleep:\n"
+          "                     pause, continue, complete or ignore (default)\n"
+#endif
+#ifdef WITH_DDC
+          "  --ddc-delay=MILLIS time a DDC/CI monitor needs between commands\n"
+          "                     (default: 50)\n"
+#endif
+          "  --low-jitter[=POLICY]\n"
+          "                     keep fade steps on time under load: reduce timer\n"
+          "                     slack, lock memory and optionally use the realtime\n"
+          "                     scheduling POLICY fifo or rr\n"
+          "  --stats            print the number of method calls and how late fade\n"
+          "                     steps were when done\n"
+          "  --profile          print how long each stage of startup took\n"
+          "  --query            print the state of the devices without using DBus\n"
+          "  --follow           like --query, then print devices again whenever they\n"
+          "                     change\n"
+          "  --format=FORMAT    output format of --query and --follow: tsv (default),\n"
+          "                     json or percent\n"
+          "  --stdin            read commands from standard input, one per line:\n"
+          "                     get, set BRIGHTNESS, fade COUNTDOWN BRIGHTNESS or\n"
+          "                     sleep SECONDS, optionally followed by a device name\n"
+          "  --batch            with --stdin, apply consecutive sets at once\n"
+#ifdef WITH_DAEMON
+          "  --daemon           stay resident and accept new targets mid-fade\n"
+#endif
+#ifdef WITH_MIRROR
+          "  --mirror           stay resident and copy the brightness of the first\n"
+          "                     device onto the others\n"
+          "  --curve=EXPONENT   map brightness through a power curve when mirroring\n"
+          "  --uevents=FIFO     read hotplug events from FIFO instead of the kernel\n"
+#endif
+#ifdef WITH_KEYS
+          "  --keys[=EVDEV]     stay resident and handle the brightness keys of the\n"
+          "                     input devices which have them, or of EVDEV, which\n"
+          "                     may be a comma separated list\n"
+          "  --key-step=PERCENT step per key press (default: 5)\n"
+#endif
+#ifdef WITH_IDLE
+          "  --idle=BRIGHTNESS  stay resident, fading to BRIGHTNESS over COUNTDOWN\n"
+          "                     while the session is idle\n"
+#endif
+#ifdef WITH_AUTO
+          "  --auto[=SENSOR]    stay resident and follow the ambient light sensor,\n"
+          "                     fading over COUNTDOWN; SENSOR is its IIO device\n"
+          "                     directory\n"
+          "  --als-curve=CURVE  map lux to brightness through LUX:PERCENT,...\n"
+          "                     (default: " DEFAULT_ALS_CURVE ")\n"
+          "  --als-buffer=FIFO  read the sensor's scans from FIFO instead of its\n"
+          "                     character device\n"
+#endif
+#ifdef WITH_SCHEDULE
+          "  --schedule=FILE    stay resident and change the brightness at the times\n"
+          "                     of day in FILE, one HH:MM[:SS] BRIGHTNESS [COUNTDOWN]\n"
+          "                     per line\n"
+#endif
+          ;
+    struct backend backend = {};
+    const char *brightness_str = NULL,
+               *countdown_str = NULL,
+               *rate_str = NULL,
+               *jnd_str = NULL,
+               *format_str = NULL,
+               *on_external_str = NULL,
+               *clock_str = NULL,
+               *sched_str = NULL,
+               *idle_str = NULL,
+               *schedule_path = NULL,
+               *type_preference = DEFAULT_TYPE_PREFERENCE;
+    struct device *devices = NULL;
+    int num_devices = 0;
     int status = 0;
     float countdown_sec;
-    int total_millis;
-    struct timespec start_time,
-                    current_time,
-                    target_time;
+    int steps_per_sec = DEFAULT_STEPS_PER_SEC;
+    float jnd_percent = 0;
+    int sched_policy = SCHED_OTHER;
+    enum query_format query_format = QUERY_TSV;
+    enum external_policy on_external = EXTERNAL_IGNORE;
+    bool show_stats = false,
+         daemon_mode = false,
+         mirror_mode = false,
+         query_mode = false,
+         follow_mode = false,
+         stdin_mode = false,
+         keys_mode = false,
+         auto_mode = false,
+         batch = false,
+         all_devices = false,
+         keyboard = false,
+         low_jitter = false,
+         have_changes = false;
+#ifdef WITH_DBUS
+    const char *on_sleep_str = NULL;
+#endif
+#ifdef WITH_DDC
+    const char *ddc_delay_str = NULL;
+#endif
+#ifdef WITH_DAEMON
+    bool cancelled_other;
+#endif
+#ifdef WITH_MIRROR
+    const char *curve_str = NULL,
+               *uevent_source = NULL;
+    float curve = 1;
+#endif
+#ifdef WITH_KEYS
+    const char *key_sources = NULL,
+               *key_step_str = NULL;
+    float key_step_percent = DEFAULT_KEY_STEP_PERCENT;
+#endif
+#ifdef WITH_AUTO
+    const char *als_path = NULL,
+               *als_buffer = NULL,
+               *als_curve_str = NULL;
+    struct lux_point als_curve[ALS_CURVE_MAX_POINTS];
+    int als_curve_points;
+    struct als als = {.dfd = -1, .buffer_fd = -1};
+#endif
+#ifdef WITH_SCHEDULE
+    struct schedule_event *schedule = NULL;
+    int num_schedule_events = 0;
+#endif
+    struct fade_stats stats = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &profile_start);
 
     // Parse arguments
     for (int i = 1; i < argc;) {
@@ -321,6 +4754,116 @@ int main(int argc, char *argv[]) {
             continue;
         }
         if (opt_len < 2) goto bad_args;
+        if (argv[i][1] == '-') {
+            const char *arg = argv[i++], *value;
+            if (match_long_opt(arg, "stats", &value) && !value) {
+                show_stats = true;
+                continue;
+            }
+            if (match_long_opt(arg, "profile", &value) && !value) {
+                profile_on = true;
+                continue;
+            }
+            if (match_long_opt(arg, "daemon", &value) && !value) {
+                daemon_mode = true;
+                continue;
+            }
+            if (match_long_opt(arg, "query", &value) && !value) {
+                query_mode = true;
+                continue;
+            }
+            if (match_long_opt(arg, "follow", &value) && !value) {
+                follow_mode = true;
+                continue;
+            }
+            if (match_long_opt(arg, "stdin", &value) && !value) {
+                stdin_mode = true;
+                continue;
+            }
+            if (match_long_opt(arg, "batch", &value) && !value) {
+                batch = true;
+                continue;
+            }
+            if (match_long_opt(arg, "all", &value) && !value) {
+                all_devices = true;
+                continue;
+            }
+            if (match_long_opt(arg, "keyboard", &value) && !value) {
+                keyboard = true;
+                continue;
+            }
+            if (match_long_opt(arg, "mirror", &value) && !value) {
+                mirror_mode = true;
+                continue;
+            }
+            if (match_long_opt(arg, "low-jitter", &value)) {
+                low_jitter = true;
+                sched_str = value;
+                continue;
+            }
+            if (match_long_opt(arg, "keys", &value)) {
+                keys_mode = true;
+#ifdef WITH_KEYS
+                key_sources = value;
+#endif
+                continue;
+            }
+            if (match_long_opt(arg, "auto", &value)) {
+                auto_mode = true;
+#ifdef WITH_AUTO
+                als_path = value;
+#endif
+                continue;
+            }
+#ifdef WITH_MIRROR
+            if (match_long_opt(arg, "curve", &value)) {
+                curve_str = value ? value : argv[i++];
+            } else if (match_long_opt(arg, "uevents", &value)) {
+                uevent_source = value ? value : argv[i++];
+            } else
+#endif
+#ifdef WITH_KEYS
+            if (match_long_opt(arg, "key-step", &value)) {
+                key_step_str = value ? value : argv[i++];
+            } else
+#endif
+#ifdef WITH_AUTO
+            if (match_long_opt(arg, "als-curve", &value)) {
+                als_curve_str = value ? value : argv[i++];
+            } else if (match_long_opt(arg, "als-buffer", &value)) {
+                als_buffer = value ? value : argv[i++];
+            } else
+#endif
+            if (match_long_opt(arg, "idle", &value)) {
+                idle_str = value ? value : argv[i++];
+            } else if (match_long_opt(arg, "schedule", &value)) {
+                schedule_path = value ? value : argv[i++];
+            } else if (match_long_opt(arg, "rate", &value)) {
+                rate_str = value ? value : argv[i++];
+            } else if (match_long_opt(arg, "jnd", &value)) {
+                jnd_str = value ? value : argv[i++];
+            } else if (match_long_opt(arg, "prefer", &value)) {
+                type_preference = value ? value : argv[i++];
+            } else if (match_long_opt(arg, "format", &value)) {
+                format_str = value ? value : argv[i++];
+            } else if (match_long_opt(arg, "on-external", &value)) {
+                on_external_str = value ? value : argv[i++];
+            } else if (match_long_opt(arg, "clock", &value)) {
+                clock_str = value ? value : argv[i++];
+#ifdef WITH_DBUS
+            } else if (match_long_opt(arg, "on-sleep", &value)) {
+                on_sleep_str = value ? value : argv[i++];
+#endif
+#ifdef WITH_DDC
+            } else if (match_long_opt(arg, "ddc-delay", &value)) {
+                ddc_delay_str = value ? value : argv[i++];
+#endif
+            } else {
+                goto bad_args;
+            }
+            if (i > argc) goto bad_args;
+            continue;
+        }
         if (argv[i][1] == 'h') goto show_usage;
         if (argv[i][1] == 'v') {
             debug_on = true;
@@ -335,72 +4878,453 @@ int main(int argc, char *argv[]) {
         if (i == argc-1) goto bad_args;
         switch (argv[i][1]) {
             case 'd':
-                device_name = argv[i+1];
+                status = add_device_list(&devices, &num_devices, argv[i+1]);
+                if (status < 0) {
+                    goto finish;
+                }
                 break;
             case 't':
                 countdown_str = argv[i+1];
                 break;
+#ifdef WITH_DBUS
+            case 'x':
+                backend.session.id = argv[i+1];
+                break;
+#endif
             default:
                 goto bad_args;
         }
         i += 2;
     }
+    if (rate_str) {
+        status = read_steps_per_sec(rate_str, &steps_per_sec);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+    if (jnd_str) {
+        status = read_jnd(jnd_str, &jnd_percent);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+    if (on_external_str) {
+        status = read_external_policy(on_external_str, &on_external);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+    if (clock_str) {
+        status = read_clock(clock_str, &fade_clock);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+    if (sched_str) {
+        status = read_sched_policy(sched_str, &sched_policy);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+    if (show_stats) {
+        stats.lateness = calloc(STEP_LATENESS_SAMPLES, sizeof(*stats.lateness));
+        if (!stats.lateness) {
+            perror("calloc");
+            status = -1;
+            goto finish;
+        }
+    }
+#ifdef WITH_DDC
+    if (ddc_delay_str) {
+        status = read_ddc_delay(ddc_delay_str, &ddc_delay_millis);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+#endif
+#ifdef WITH_DBUS
+    if (on_sleep_str) {
+        status = read_sleep_policy(on_sleep_str, &on_sleep);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+#endif
+    if (batch && !stdin_mode) goto bad_args;
+    if (format_str) {
+        if (!query_mode && !follow_mode) goto bad_args;
+        status = read_query_format(format_str, &query_format);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+#ifdef WITH_MIRROR
+    if (curve_str) {
+        status = read_curve(curve_str, &curve);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+#endif
+#ifdef WITH_KEYS
+    if (key_step_str) {
+        if (!keys_mode) goto bad_args;
+        status = read_key_step(key_step_str, &key_step_percent);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+#endif
+#ifdef WITH_AUTO
+    if (!auto_mode && (als_buffer || als_curve_str)) goto bad_args;
+    status = read_als_curve(als_curve_str ? als_curve_str : DEFAULT_ALS_CURVE,
+                            als_curve, &als_curve_points);
+    if (status < 0) {
+        goto finish;
+    }
+#endif
+
+    profile_mark("arguments parsed");
+
+    // Start connecting to the bus right away if we are likely to need it.
+    // Connecting doesn't wait for the server, so the handshake proceeds
+    // while we read sysfs; sd-bus only waits for it to finish before the
+    // first method call. Errors are reported when the bus is needed.
+#ifdef WITH_DBUS
+    if (brightness_str || daemon_mode || mirror_mode || stdin_mode || keys_mode
+        || idle_str || auto_mode || schedule_path)
+    {
+        if (connect_system_bus(&backend.bus) < 0) {
+            backend.bus = NULL;
+        }
+        profile_mark("bus connection started");
+    }
+#endif
+
+    // Find device names
+    if (all_devices) {
+        if (num_devices > 0) goto bad_args;
+        status = get_all_devices(type_preference, &devices, &num_devices);
+        if (status < 0) {
+            goto finish;
+        }
+    }
+    if (keyboard) {
+        status = get_keyboard_devices(&devices, &num_devices);
+        if (status < 0) {
+            goto finish;
+        }
+    } else if (!all_devices && num_devices == 0) {
+        const char *device_name;
+        status = get_device(type_preference, &device_name);
+        if (status < 0) {
+            goto finish;
+        }
+        if (!add_device(&devices, &num_devices, "backlight", device_name)) {
+            status = -1;
+            goto finish;
+        }
+    }
 
-    // Find device name
-    if (device_name == NULL) {
-        status = get_device(&device_name);
+    if (query_mode || follow_mode) {
+        if (brightness_str || countdown_str || daemon_mode || mirror_mode
+            || stdin_mode || keys_mode || idle_str || auto_mode || schedule_path
+            || (query_mode && follow_mode))
+        {
+            goto bad_args;
+        }
+        if (query_mode) {
+            status = run_query(devices, num_devices, query_format);
+            goto finish;
+        }
+        status = setup_signal_handler();
         if (status < 0) {
             goto finish;
         }
+        status = run_follow(devices, num_devices, query_format, steps_per_sec);
+        goto finish;
     }
-    LOG_INFO("Using device %s\n", device_name);
 
     // Get current brightness levels
-    status = read_brightness(device_name, &cur_brightness, &max_brightness);
-    if (status < 0) {
+    for (int i = 0; i < num_devices; i++) {
+        struct device *dev = &devices[i];
+        LOG_INFO("Using device %s\n", dev->name);
+        status = read_brightness(dev, &dev->cur_brightness, &dev->max_brightness);
+        if (status < 0) {
+            goto finish;
+        }
+        dev->orig_brightness = dev->cur_brightness;
+    }
+    profile_mark("brightness read");
+    if (low_jitter) {
+        enter_low_jitter(sched_policy);
+    }
+
+    if (stdin_mode) {
+        if (brightness_str || countdown_str || daemon_mode || mirror_mode
+            || keys_mode || idle_str || auto_mode || schedule_path)
+        {
+            goto bad_args;
+        }
+        status = backend_open(&backend, devices, num_devices);
+        if (status < 0) {
+            goto finish;
+        }
+        status = setup_signal_handler();
+        if (status < 0) {
+            goto finish;
+        }
+        initialize_signals_to_catch_set();
+        status = run_stdin(&backend, devices, num_devices, batch, steps_per_sec,
+                           jnd_percent, on_external, &stats);
+        goto print_stats;
+    }
+
+    if (keys_mode) {
+#ifdef WITH_KEYS
+        if (brightness_str || countdown_str || daemon_mode || mirror_mode
+            || idle_str || auto_mode || schedule_path)
+        {
+            goto bad_args;
+        }
+        status = backend_open(&backend, devices, num_devices);
+        if (status < 0) {
+            goto finish;
+        }
+        status = setup_signal_handler();
+        if (status < 0) {
+            goto finish;
+        }
+        initialize_signals_to_catch_set();
+        status = run_keys(&backend, devices, num_devices, key_sources,
+                          key_step_percent, &stats);
+        goto print_stats;
+#else
+        LOG_ERROR("This build doesn't support --keys\n");
+        status = -1;
+        goto finish;
+#endif
+    }
+
+    if (idle_str) {
+#ifdef WITH_IDLE
+        if (brightness_str || daemon_mode || mirror_mode || auto_mode
+            || schedule_path)
+        {
+            goto bad_args;
+        }
+        status = read_countdown(countdown_str, &countdown_sec);
+        if (status < 0) {
+            goto finish;
+        }
+        status = backend_open(&backend, devices, num_devices);
+        if (status < 0) {
+            goto finish;
+        }
+        status = setup_signal_handler();
+        if (status < 0) {
+            goto finish;
+        }
+        initialize_signals_to_catch_set();
+        status = run_idle(&backend, devices, num_devices, idle_str, countdown_sec,
+                          steps_per_sec, jnd_percent, on_external, &stats);
+        goto print_stats;
+#else
+        LOG_ERROR("This build doesn't support --idle\n");
+        status = -1;
+        goto finish;
+#endif
+    }
+
+    if (auto_mode) {
+#ifdef WITH_AUTO
+        if (brightness_str || daemon_mode || mirror_mode || schedule_path) {
+            goto bad_args;
+        }
+        status = read_countdown(countdown_str, &countdown_sec);
+        if (status < 0) {
+            goto finish;
+        }
+        status = open_als(als_path, als_buffer, &als);
+        if (status < 0) {
+            goto finish;
+        }
+        status = backend_open(&backend, devices, num_devices);
+        if (status < 0) {
+            goto finish;
+        }
+        status = setup_signal_handler();
+        if (status < 0) {
+            goto finish;
+        }
+        initialize_signals_to_catch_set();
+        status = run_auto(&backend, devices, num_devices, &als, als_curve,
+                          als_curve_points, countdown_sec, steps_per_sec,
+                          jnd_percent, on_external, &stats);
+        goto print_stats;
+#else
+        LOG_ERROR("This build doesn't support --auto\n");
+        status = -1;
+        goto finish;
+#endif
+    }
+
+    if (schedule_path) {
+#ifdef WITH_SCHEDULE
+        if (brightness_str || daemon_mode || mirror_mode) goto bad_args;
+        status = read_countdown(countdown_str, &countdown_sec);
+        if (status < 0) {
+            goto finish;
+        }
+        status = read_schedule(schedule_path, &schedule, &num_schedule_events);
+        if (status < 0) {
+            goto finish;
+        }
+        status = backend_open(&backend, devices, num_devices);
+        if (status < 0) {
+            goto finish;
+        }
+        status = setup_signal_handler();
+        if (status < 0) {
+            goto finish;
+        }
+        initialize_signals_to_catch_set();
+        status = run_schedule(&backend, devices, num_devices, schedule,
+                              num_schedule_events, countdown_sec, steps_per_sec,
+                              jnd_percent, on_external, &stats);
+        goto print_stats;
+#else
+        LOG_ERROR("This build doesn't support --schedule\n");
+        status = -1;
+        goto finish;
+#endif
+    }
+
+    if (daemon_mode) {
+#ifdef WITH_DAEMON
+        struct device *dev = &devices[0];
+        if (brightness_str || countdown_str || num_devices != 1) goto bad_args;
+        status = acquire_device_lock(dev, &dev->lock_fd, &cancelled_other);
+        if (status < 0) {
+            goto finish;
+        }
+        if (cancelled_other) {
+            status = read_brightness(dev, &dev->cur_brightness, &dev->max_brightness);
+            if (status < 0) {
+                goto finish;
+            }
+        }
+        status = backend_open(&backend, dev, 1);
+        if (status < 0) {
+            goto finish;
+        }
+        status = setup_signal_handler();
+        if (status < 0) {
+            goto finish;
+        }
+        initialize_signals_to_catch_set();
+        status = run_daemon(&backend, dev, steps_per_sec, jnd_percent, &stats);
+        goto print_stats;
+#else
+        LOG_ERROR("This build doesn't support --daemon\n");
+        status = -1;
+        goto finish;
+#endif
+    }
+
+    if (mirror_mode) {
+#ifdef WITH_MIRROR
+        if (brightness_str || countdown_str || daemon_mode
+            || (num_devices < 2 && !all_devices))
+        {
+            goto bad_args;
+        }
+        // The leader is only ever read
+        status = backend_open(&backend, devices + 1, num_devices - 1);
+        if (status < 0) {
+            goto finish;
+        }
+        status = setup_signal_handler();
+        if (status < 0) {
+            goto finish;
+        }
+        initialize_signals_to_catch_set();
+        status = run_mirror(&backend, &devices, &num_devices, all_devices,
+                            uevent_source, steps_per_sec, curve, &stats);
+        goto print_stats;
+#else
+        LOG_ERROR("This build doesn't support --mirror\n");
+        status = -1;
         goto finish;
+#endif
     }
-    orig_brightness = cur_brightness;
 
     if (brightness_str == NULL) {
         // Just print current values
-        printf("%u %u\n", cur_brightness, max_brightness);
+        for (int i = 0; i < num_devices; i++) {
+            if (num_devices > 1) {
+                printf("%s ", devices[i].name);
+            }
+            printf("%u %u\n", devices[i].cur_brightness, devices[i].max_brightness);
+        }
         goto finish;
     }
 
-    // Calculate desired brightness
-    status = calculate_target_brightness(
-        brightness_str, cur_brightness, max_brightness, &target_brightness);
-    if (status < 0) {
-        goto finish;
+    // Calculate desired brightness. Relative values are checked against
+    // the pending target which claim_device() will apply them to, not the
+    // brightness sysfs reports mid-fade.
+    for (int i = 0; i < num_devices; i++) {
+        struct device *dev = &devices[i];
+        int base_brightness;
+        status = get_base_brightness(
+            dev, dev->cur_brightness, dev->max_brightness, &base_brightness);
+        if (status < 0) {
+            goto finish;
+        }
+        status = calculate_target_brightness(
+            brightness_str, base_brightness, dev->max_brightness,
+            &dev->target_brightness);
+        if (status < 0) {
+            goto finish;
+        }
+        LOG_INFO("New brightness for %s will be %u\n", dev->name, dev->target_brightness);
     }
-    LOG_INFO("New brightness will be %u\n", target_brightness);
 
     // Calculate countdown
     status = read_countdown(countdown_str, &countdown_sec);
     if (status < 0) {
         goto finish;
     }
-    total_millis = countdown_sec * MILLISEC_PER_SEC;
-    if (clock_gettime(CLOCK_BOOTTIME, &current_time) < 0) {
-        perror("clock_gettime");
-        goto finish;
+
+    // Drop the devices which a daemon took care of
+    for (int i = 0; i < num_devices;) {
+        status = claim_device(&devices[i], brightness_str, countdown_sec);
+        if (status < 0) {
+            goto finish;
+        }
+        if (status == 1) {
+            devices[i] = devices[--num_devices];
+        } else {
+            i++;
+        }
     }
-    add_nanoseconds_to_timespec(&current_time, (long)(countdown_sec * NANOSEC_PER_SEC), &target_time);
+    rebuild_device_index(devices, num_devices);
+    status = 0;
+    profile_mark("devices claimed");
 
-    // Connect to the system bus
-    status = sd_bus_open_system(&bus);
-    if (status < 0) {
-        LOG_ERROR("Failed to connect to systemd bus: %s\n", strerror(-status));
-        goto finish;
+    // Don't even connect to the bus if there is nothing to change
+    for (int i = 0; i < num_devices; i++) {
+        have_changes |= devices[i].target_brightness != devices[i].cur_brightness;
+    }
+    if (!have_changes) {
+        LOG_INFO("Brightness is already at the target\n");
+        goto print_stats;
     }
 
-    // Get session path
-    status = get_session_path(bus, &session_object_path);
+    status = backend_open(&backend, devices, num_devices);
     if (status < 0) {
         goto finish;
     }
-    LOG_INFO("Session object path: %s\n", session_object_path);
 
     // Set up the signal handler
     status = setup_signal_handler();
@@ -410,47 +5334,18 @@ int main(int argc, char *argv[]) {
     initialize_signals_to_catch_set();
 
     // Set the brightness
-    memcpy(&start_time, &current_time, sizeof(start_time));
-    while (!received_signal && timespec_cmp(&current_time, &target_time) < 0) {
-        status = nanosleep(&delay_ts, NULL);
-        clock_gettime(CLOCK_BOOTTIME, &current_time);
-        if (status < 0) {
-            if (!received_signal) {
-                perror("nanosleep");
-            }
-            break;
-        }
-        int millis_elapsed = timespec_diff_in_millis(&current_time, &start_time);
-        if (millis_elapsed >= total_millis) break;
-        // next = (1 - (millis_elapsed / total_millis)) * orig_brightness
-        //      = orig_brightness - (millis_elapsed * orig_brightness) / total_millis
-        int next_brightness = (int)(orig_brightness - ((int64_t)millis_elapsed * orig_brightness) / total_millis);
-        if (next_brightness != cur_brightness) {
-            status = set_brightness(
-                bus, session_object_path, &error, device_name, next_brightness);
-            if (status < 0) {
-                goto method_failed;
-            }
-            cur_brightness = next_brightness;
-        }
-    }
+    status = run_fade(&backend, devices, num_devices,
+                      countdown_sec, steps_per_sec, jnd_percent, on_external,
+                      &stats);
 
-    if (received_signal) {
-        LOG_INFO("Received signal, restoring original brightness\n");
-        if (cur_brightness != orig_brightness) {
-            status = set_brightness(
-                bus, session_object_path, &error, device_name, orig_brightness);
-            if (status < 0) {
-                goto method_failed;
-            }
-        }
-    } else if (cur_brightness != target_brightness) {
-        // We might need one more step
-        status = set_brightness(
-            bus, session_object_path, &error, device_name, target_brightness);
-        if (status < 0) {
-            goto method_failed;
-        }
+print_stats:
+    if (show_stats) {
+        fprintf(stderr, "%d SetBrightness calls for %d levels "
+                "(%d saved, %d merged below JND)\n",
+                stats.calls, stats.levels,
+                stats.levels > stats.calls ? stats.levels - stats.calls : 0,
+                stats.merged);
+        print_step_lateness(&stats);
     }
 
     if (0) {
@@ -459,16 +5354,36 @@ bad_args:
 show_usage:
         LOG_ERROR(usage_fmt_str, argv[0]);
         goto finish;
-method_failed:
-        log_method_call_failed(&error);
-        goto finish;
     }
 finish:
-    sd_bus_error_free(&error);
-    sd_bus_close_unref(bus);
-    if (session_object_path) {
-        free(session_object_path);
+    profile_mark("done");
+    backend_close(&backend);
+#ifdef WITH_AUTO
+    close_als(&als);
+#endif
+#ifdef WITH_SCHEDULE
+    free(schedule);
+#endif
+    free(stats.lateness);
+    for (int i = 0; i < num_devices; i++) {
+        if (devices[i].lock_fd >= 0) {
+            close(devices[i].lock_fd);
+        }
+#ifdef WITH_SYSFS
+        if (devices[i].brightness_fd >= 0) {
+            close(devices[i].brightness_fd);
+        }
+#endif
+#ifdef WITH_DDC
+        if (devices[i].ddc_fd >= 0) {
+            close(devices[i].ddc_fd);
+        }
+        if (devices[i].ddc_cache_fd >= 0) {
+            close(devices[i].ddc_cache_fd);
+        }
+#endif
     }
+    free(devices);
 
     return status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
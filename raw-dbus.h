@@ -0,0 +1,78 @@
+#ifndef RAW_DBUS_H
+#define RAW_DBUS_H
+
+// A minimal D-Bus client which speaks the wire protocol directly over the
+// system bus socket, for static builds without libsystemd. It implements
+// the subset of the sd-bus API used by backlight-dbus with the same
+// semantics: EXTERNAL authentication, Hello, method calls whose arguments
+// consist of basic types, replies with at most one level of arrays,
+// properties of basic types, and signal matches on path, interface and
+// member. Anything else fails with -EOPNOTSUPP.
+
+#include <stdint.h>
+
+typedef struct sd_bus sd_bus;
+typedef struct sd_bus_message sd_bus_message;
+typedef struct sd_bus_slot sd_bus_slot;
+
+typedef struct sd_bus_error {
+    const char *name;
+    const char *message;
+    int _need_free;
+} sd_bus_error;
+
+#define SD_BUS_ERROR_NULL ((const sd_bus_error) {NULL, NULL, 0})
+#define SD_BUS_ERROR_UNKNOWN_OBJECT "org.freedesktop.DBus.Error.UnknownObject"
+
+typedef int (*sd_bus_message_handler_t)(sd_bus_message *m, void *userdata,
+                                        sd_bus_error *ret_error);
+
+int sd_bus_new(sd_bus **ret);
+int sd_bus_set_address(sd_bus *bus, const char *address);
+int sd_bus_set_bus_client(sd_bus *bus, int b);
+int sd_bus_negotiate_fds(sd_bus *bus, int b);
+int sd_bus_negotiate_creds(sd_bus *bus, int b, uint64_t creds_mask);
+int sd_bus_start(sd_bus *bus);
+sd_bus *sd_bus_unref(sd_bus *bus);
+sd_bus *sd_bus_close_unref(sd_bus *bus);
+
+int sd_bus_get_fd(sd_bus *bus);
+int sd_bus_get_events(sd_bus *bus);
+int sd_bus_process(sd_bus *bus, sd_bus_message **r);
+int sd_bus_wait(sd_bus *bus, uint64_t timeout_usec);
+
+int sd_bus_call_method(sd_bus *bus, const char *destination, const char *path,
+                       const char *interface, const char *member,
+                       sd_bus_error *ret_error, sd_bus_message **reply,
+                       const char *types, ...);
+int sd_bus_call_method_async(sd_bus *bus, sd_bus_slot **slot,
+                             const char *destination, const char *path,
+                             const char *interface, const char *member,
+                             sd_bus_message_handler_t callback, void *userdata,
+                             const char *types, ...);
+int sd_bus_match_signal(sd_bus *bus, sd_bus_slot **slot, const char *sender,
+                        const char *path, const char *interface,
+                        const char *member, sd_bus_message_handler_t callback,
+                        void *userdata);
+int sd_bus_get_property_trivial(sd_bus *bus, const char *destination,
+                                const char *path, const char *interface,
+                                const char *member, sd_bus_error *ret_error,
+                                char type, void *ret_ptr);
+int sd_bus_get_property_string(sd_bus *bus, const char *destination,
+                               const char *path, const char *interface,
+                               const char *member, sd_bus_error *ret_error,
+                               char **ret);
+
+int sd_bus_message_read(sd_bus_message *m, const char *types, ...);
+int sd_bus_message_enter_container(sd_bus_message *m, char type,
+                                   const char *contents);
+const sd_bus_error *sd_bus_message_get_error(sd_bus_message *m);
+sd_bus_message *sd_bus_message_unref(sd_bus_message *m);
+
+int sd_bus_path_encode(const char *prefix, const char *external_id,
+                       char **ret_path);
+
+void sd_bus_error_free(sd_bus_error *e);
+int sd_bus_error_has_name(const sd_bus_error *e, const char *name);
+
+#endif